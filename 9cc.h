@@ -2,15 +2,24 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdnoreturn.h>
 #include <string.h>
 
 typedef struct Type Type;
 typedef struct Member Member;
 
+// 128ビットのハッシュ値 (cache.c)
+typedef unsigned __int128 Hash;
+
 //
 // トークナイザー (tokenize.c)
 //
@@ -24,42 +33,83 @@ typedef enum {
   TK_EOF,      // 入力の終わりを表すトークン
 } TokenKind;
 
-// トークンの型
-typedef struct Token Token;
-struct Token {
-  TokenKind kind;
-  Token *next;
-  long val;         // トークンの種類がTK_NUMの場合、その値
-  char *str;        // トークンの文字列
-  int len;          // トークンの長さ
-
-  char *contents;   // 終端文字'\0'を含む文字列リテラル
-  char cont_len;    // 文字列リテラルの長さ
-};
+// 文字列リテラルの中身
+// エスケープを含まないリテラルは、コピーせずに入力中のバイト列を直接指す。
+// そのため contents は '\0' で終端しているとは限らない。
+typedef struct {
+  char *contents;   // 文字列リテラルの中身
+  int len;          // 中身のバイト数（終端文字'\0'を含まない）
+  bool owned;       // contents をエスケープを展開して別に確保したかどうか。確保したものは解放する
+} StrLit;
+
+// トークン列の型
+// トークンごとの情報を種類ごとの配列に分けて持つ (structure of arrays)。
+// 個々のトークンは配列の添字で表し、添字 0 は「トークンなし」を表すために使わない。
+typedef struct {
+  unsigned char *kind; // トークンの種類 (TokenKind)
+  int *loc;            // 入力の先頭からのバイトオフセット
+  int *len;            // トークンの長さ
+  int *aux;            // TK_NUM なら vals の、TK_STR なら strs の添字
+  int cnt;
+  int cap;
+
+  long *vals;          // TK_NUM の値
+  int nvals;
+  int vals_cap;
+
+  StrLit *strs;        // TK_STR の中身
+  int nstrs;
+  int strs_cap;
+} TokenStream;
+
+// エラーメッセージを出力した後に呼ぶ。コンパイル中なら compile() に戻り、そうでなければ exit する
+noreturn void bail(void);
 
 // エラーを報告するための関数
 // printfと同じ引数を取る
-void error(char *fmt, ...);
+// コンパイル中なら compile() に戻り、そうでなければ exit する
+noreturn void error(char *fmt, ...);
 
 // エラー箇所を報告する
 // loc は入力全体を表す文字列の途中を指しているポインタ
 // fmt は入力の先頭を指しているポインタ
-void error_at(char *loc, char *fmt, ...);
+noreturn void error_at(char *loc, char *fmt, ...);
+
+noreturn void error_tok(int tok, char *fmt, ...);
+
+// 目的：トークンの添字を受け取り、入力中のトークンの文字列の先頭を返す
+// tok_str : int -> char *
+char *tok_str(int tok);
 
-void error_tok(Token *tok, char *fmt, ...);
+// 目的：トークンが入力の何行目にあるかを返す。入力の先頭から数えるので、頻繁には呼ばない
+// tok_line : int -> int
+int tok_line(int tok);
+int tok_column(int tok);
+
+// 目的：整数トークンの値を返す
+// tok_val : int -> long
+long tok_val(int tok);
+
+// 目的：文字列リテラルのトークンの中身を返す
+// tok_strlit : int -> StrLit
+StrLit *tok_strlit(int tok);
+
+// 目的：cc->tokens のトークンを1行に1つずつ out に書き出す
+// print_tokens : FILE -> void
+void print_tokens(FILE *out);
 
 // 目的：文字列を受け取り、現在のトークンとマッチするかどうかを調べる。
-// マッチしていれば、トークンを返す。
-// peek : char * -> Token || NULL
-Token *peek(char *s);
+// マッチしていれば、トークンの添字を返す。
+// peek : char * -> int || 0
+int peek(char *s);
 
 // 次のトークンが期待している記号の時には、トークンを1つ読み進めて
-// 真を返す。それ以外の場合には偽を返す。
-Token *consume(char *op);
+// その添字を返す。それ以外の場合には 0 を返す。
+int consume(char *op);
 
 // 目的：トークンの種類が識別子かどうかを調べる。
-// 違う場合は NULL を返す。もしそうなら、トークンを1つ読み進めてそのポインタを返す。
-Token *consume_ident(void);
+// 違う場合は 0 を返す。もしそうなら、トークンを1つ読み進めてその添字を返す。
+int consume_ident(void);
 
 // 次のトークンが期待している記号の時には、トークンを1つ読み進める。
 // それ以外の場合にはエラーを報告する。
@@ -77,15 +127,38 @@ char *expect_ident(void);
 // at_eof : bool
 bool at_eof(void);
 
-// 入力文字列 p をトークナイズしてそれを返す
-Token *tokenize();
+// 入力文字列をトークナイズして cc->tokens に格納し、先頭のトークンの添字を返す
+int tokenize(void);
+
+//
+// アリーナ (arena.c)
+//
+
+// アリーナ。大きなブロックから小さなオブジェクトを切り出して確保し、まとめて解放する。
+// 関数の AST とローカル変数はアリーナ cc->arena に、
+// グローバル変数や型のようにコンパイルが終わるまで使うものは cc->file_arena に置く。
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t used;
+  size_t cap;
+  _Alignas(16) char data[];   // 切り出す領域は16バイト境界に揃える
+};
 
-// ファイルの名前
-extern char *filename;
-// 入力プログラム
-extern char *user_input;
-// 現在着目しているトークン
-extern Token *token;
+typedef struct {
+  ArenaBlock *head;
+} Arena;
+
+// 目的：0 で埋めた size バイトの領域をアリーナから確保する
+void *arena_alloc(Arena *a, size_t size);
+// 目的：s の先頭 len バイトを、'\0' で終わる文字列としてアリーナに複製する
+char *arena_strndup(Arena *a, char *s, size_t len);
+// 目的：アリーナの中身をすべて捨てる。最後に確保したブロックは次に使うために残す
+void arena_reset(Arena *a);
+// 目的：アリーナのブロックをすべて解放する
+void arena_free(Arena *a);
+// 目的：解放したブロックを max_bytes まではプールに取っておき、次のアリーナで使い回す
+void arena_retain(size_t max_bytes);
 
 //
 // パーサー (parse.c)
@@ -102,8 +175,8 @@ struct Var {
   int offset;     // RBPからのオフセット
 
   // グローバル変数
-  char *contents;
-  int cont_len;
+  char *contents; // 文字列リテラルの中身。'\0' で終端しているとは限らない
+  int cont_len;   // 終端文字'\0'を含めた長さ
 };
 
 // ローカル変数の連結リストの型
@@ -144,48 +217,112 @@ typedef enum {
 } NodeKind;
 
 // ノードの型
+// 全ノードに共通のヘッダの後ろに、kind ごとに必要なフィールドだけを union で持つ。
+// new_node() は kind に応じたサイズしか確保しないので、
+// kind が使わないフィールドを読み書きしてはいけない。
 typedef struct Node Node;
 struct Node {
   NodeKind kind;  // ノードの種類
+  int tok;        // Representative token
   Node *next;     // 次のノード
   Type *ty;       // Type, e.g. int or pointer to int
-  Token *tok;     // Representative token
-
-  Node *lhs;      // 左辺
-  Node *rhs;      // 右辺
-
-  // "if", "while" or "for" statement
-  Node *cond;
-  Node *then;
-  Node *els;
-  Node *init;
-  Node *inc;
-
-  // Block or statement expression
-  Node *body;
-
-  // Struct member access
-  Member *member;
-
-  // Function Call
-  char *funcname;
-  Node *args;
-  
-  Var *var;      // kind が ND_VAR の場合のみ使う
-  long val;       // kind が ND_NUM の場合のみ使う
+
+  union {
+    // 演算子, "return", 式文, 構造体のメンバーアクセス
+    struct {
+      Node *lhs;        // 左辺
+      union {
+        Node *rhs;      // 右辺
+        Member *member; // kind が ND_MEMBER の場合のみ使う
+      };
+    };
+
+    // "if", "while" or "for" statement
+    struct {
+      Node *cond;
+      Node *then;
+      Node *els;
+      Node *init;
+      Node *inc;
+    };
+
+    // Block or statement expression
+    Node *body;
+
+    // Function Call
+    struct {
+      char *funcname;
+      Node *args;
+    };
+
+    Var *var;       // kind が ND_VAR の場合のみ使う
+    long val;       // kind が ND_NUM の場合のみ使う
+  };
 };
 
 
+// 関数ごとに生成したコードの統計 (--codegen-stats)
+typedef struct {
+  int insns;       // 命令の数
+  int pushes;      // push の数
+  int pops;        // pop の数
+  int loads;       // メモリから読む命令の数 (push と pop を除く)
+  int stores;      // メモリに書く命令の数 (push と pop を除く)
+  int branches;    // ジャンプ命令の数
+  int calls;       // call の数
+  int frame_size;  // スタックフレームの大きさ
+} CodegenStats;
+
+// 静的なコストモデルで見積もったループのコスト (--cost-report)
+typedef struct {
+  int tok;         // ループの先頭のトークン
+  int depth;       // ループのネストの深さ。一番外側が 1
+  double cost;     // ループの中の命令の重み付きのサイクル数 (内側のループを含む)
+  int divs;        // ループの中の idiv の数
+} LoopCost;
+
+// 静的なコストモデルで見積もった関数のコスト。
+// 命令ごとのサイクル数に、ループのネストの深さごとに10倍の重みを掛けて足し合わせる
+typedef struct {
+  double cost;       // 関数の命令の重み付きのサイクル数
+  int blocks;        // 基本ブロックの数
+  double block;      // 今の基本ブロックのコスト
+  char *last_def;    // 今の基本ブロックで直前の命令が書いたレジスタ。フラグなら "flags"
+  double block_max;  // 最もコストの高い基本ブロックのコスト
+  int divs;          // idiv の数
+  LoopCost *loops;   // ループ
+  int nloops;
+  int loops_cap;
+} FuncCost;
+
+// 計測用のコードを埋め込んだ関数 (-fprofile-generate)。翻訳単位の最後にカウンタの表を吐き出すために覚えておく
+typedef struct ProfFunc ProfFunc;
+struct ProfFunc {
+  ProfFunc *next;
+  char *name;        // 関数の名前
+  int ncounters;     // カウンタの数
+};
+
 // 関数の型
 typedef struct Function Function;
 struct Function {
   Function *next;
   char *name;
+  int tok;         // 関数の名前のトークン
   VarList *params; // 引数の連結リスト
 
   Node *node;
   VarList *locals; // ローカル変数の連結リスト
   int stack_size;
+
+  // インクリメンタルコンパイル
+  Hash key;        // 関数のトークン列と、それより前のグローバル変数の宣言のハッシュ値
+  char *asm_text;  // 前回の出力から再利用するアセンブリ。NULL ならコードを生成する
+  size_t asm_len;
+
+  CodegenStats cg; // 生成したコードの統計
+  FuncCost cost;   // 見積もったコスト
+  int ncounters;   // 計測用のカウンタの数。呼ばれた回数と、分岐ごとに2つ
 };
 
 // プログラムの型
@@ -196,6 +333,10 @@ typedef struct {
 
 Program *program(void);
 
+// ストリーミングモードでは、program() の代わりにトップレベルの宣言を1つずつパースする
+void parse_init(void);
+Function *toplevel(void);
+
 //
 // type.c
 //
@@ -229,6 +370,8 @@ extern Type *char_type;
 extern Type *int_type;
 
 bool is_integer(Type *ty);
+// pointer_to と array_of は intern された正準な型を返すので、
+// 同じ型どうしはポインタの比較 (==) で等しいと判定できる
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
@@ -240,4 +383,199 @@ void add_type(Node *node);
 
 void codegen(Program *prog);
 
+// ストリーミングモードでは、関数を1つずつ吐き出し、グローバル変数は最後にまとめて吐き出す
+void codegen_begin(void);
+void codegen_function(Function *fn);
+void codegen_end(VarList *globals);
+
+// 静的なコストモデル (--cost-report)。関数とループのコストを見積もり、高いものから表示する
+typedef struct CostReport CostReport;
+void cost_begin(void);
+void cost_print(FILE *out);
+void cost_free(void);
+
+//
+// コンパイル結果のキャッシュ (cache.c)
+//
+
+Hash hash_init(void);
+Hash hash_update(Hash h, void *p, size_t len);
+Hash compiler_hash(void);
+char *cache_key(char *input, size_t len, char *flags);
+bool cache_lookup(char *dir, char *key, FILE *out);
+void cache_store(char *dir, char *key, char *buf, size_t len);
+int cache_evict(char *dir, long max_bytes);
+
+//
+// 関数単位のインクリメンタルコンパイル (incremental.c)
+//
+
+typedef struct Incr Incr;
+
+void incr_load(void);
+bool incr_lookup(Function *fn);
+void incr_record(Function *fn, long offset, long len);
+void incr_save(char *out, size_t len);
+void incr_free(void);
+
+//
+// 計測結果を使った最適化 (profile.c)
+//
+
+typedef struct Profile Profile;
+
+Profile *profile_load(char *path);
+long *profile_find(Profile *prof, char *file, char *func, int *n);
+void profile_free(Profile *prof);
+
+//
+// 計測とトレース (report.c)
+//
+
+// コンパイルのフェーズ
+typedef enum {
+  PHASE_READ,     // ファイルの読み込み
+  PHASE_TOKENIZE, // トークナイズ
+  PHASE_PARSE,    // パース
+  PHASE_LAYOUT,   // ローカル変数のオフセットの割り当て
+  PHASE_CODEGEN,  // コード生成
+  NUM_PHASES,
+} Phase;
+
+// メモリの使用量を数えるオブジェクトの種類
+typedef enum {
+  MEM_TOKEN,
+  MEM_NODE,
+  MEM_TYPE,
+  MEM_VAR,
+  NUM_MEM_KINDS,
+} MemKind;
+
+// 1回のコンパイルの計測結果
+typedef struct {
+  double wall[NUM_PHASES];      // フェーズごとの実時間 (マイクロ秒)
+  double cpu[NUM_PHASES];       // フェーズごとのコンパイルしているスレッドの CPU 時間 (マイクロ秒)
+  long count[NUM_MEM_KINDS];    // 種類ごとのオブジェクトの数
+  long bytes[NUM_MEM_KINDS];    // 種類ごとに確保したバイト数
+} Stats;
+
+// フェーズの開始時刻
+typedef struct {
+  double wall;
+  double cpu;
+} Timer;
+
+Timer timer_start(void);
+void timer_stop(Timer *t, Phase phase);
+void note_alloc(MemKind kind, size_t size);
+void trace_start(void);
+double trace_begin(void);
+void trace_end(char *cat, char *name, double start);
+bool trace_finish(char *path);
+void print_time_report(FILE *out, Stats *stats);
+void print_mem_report(FILE *out, Stats *stats);
+void write_json_string(FILE *fp, char *s);
+
+//
+// コンパイラの状態 (compile.c)
+//
+
+// 1回のコンパイルに必要な状態をまとめた型。
+// 各フェーズはグローバル変数の代わりに、スレッドごとの「現在のコンパイラ」cc を通して
+// 状態を読み書きする。スレッドごとに別の Compiler を使えば、
+// 1つのプロセスの中で複数のファイルを並行にコンパイルできる。
+typedef struct Compiler Compiler;
+struct Compiler {
+  // 入力と出力
+  char *filename;       // ファイルの名前
+  char *user_input;     // 入力プログラム。NULL なら compile() が filename から読み込む
+  FILE *out;            // アセンブリの出力先
+  FILE *err;            // エラーメッセージの出力先
+  int tokenize_threads; // トークナイズに使うスレッドの数。2 以上なら大きな入力を分割して並列に処理する
+  int codegen_threads;  // コード生成に使うスレッドの数。2 以上なら関数ごとに並列に処理する
+  bool stream;          // 関数を1つずつパースして吐き出し、その AST を解放しながら進む
+  bool debug_info;      // 文ごとのソースの位置 (.file と .loc) を吐き出すかどうか
+  bool dump_tokens;     // アセンブリの代わりにトークン列を書き出すかどうか
+  char *cache_dir;      // コンパイル結果のキャッシュのディレクトリ。NULL ならキャッシュを使わない
+  bool cache_hit;       // 結果をキャッシュから取り出したかどうか
+  char *incr_path;      // 前回の出力 (.s) のパス。NULL ならインクリメンタルコンパイルをしない
+  Incr *incr;           // 前回の出力の索引と、今回の出力の索引
+  Hash globals_hash;    // これまでに読んだグローバル変数の宣言のハッシュ値
+  int funcs_reused;     // 前回の出力から再利用した関数の数
+  int funcs_total;      // 吐き出した関数の数
+  FILE *stats_out;      // 関数ごとのコードの統計 (JSON Lines) の出力先。NULL なら数えない
+  bool cost_report;     // 静的なコストモデルで関数とループのコストを見積もるかどうか
+  CostReport *cost;     // 見積もったコスト。cost_report が false なら NULL
+  char *prof_gen;       // 計測用のコードを埋め込むときの、カウンタを書き出すファイルのパス。NULL なら埋め込まない
+  ProfFunc *prof_fns;   // 計測用のコードを埋め込んだ関数 (吐き出した順)
+  ProfFunc *prof_last;
+  Profile *profile;     // 計測結果 (-fprofile-use)。NULL なら使わない
+  bool timing;          // フェーズごとの時間を stats に数えるかどうか
+  Stats stats;          // 計測結果
+  char *out_buf;        // キャッシュや索引のために出力を貯めておくバッファ
+  size_t out_len;
+
+  // トークナイザー
+  TokenStream tokens;   // トークン列
+  int token;            // 現在着目しているトークンの添字
+  int *line_starts;     // 行ごとの先頭のバイトオフセット。tok_line が行番号を二分探索で求めるための索引
+  int nlines;
+
+  // パーサー
+  VarList *locals;      // パース中の関数のローカル変数
+  VarList *globals;     // グローバル変数
+  VarList *scope;       // 現在見えている変数
+  Var **strlit_table;   // 文字列リテラルの intern テーブル
+  int strlit_cap;
+  int strlit_used;
+  Arena arena;          // 関数の AST とローカル変数を置くアリーナ
+  Arena file_arena;     // グローバル変数、型、名前など、コンパイルが終わるまで使うものを置くアリーナ
+
+  // 型
+  Type **type_table;    // 型の intern テーブル
+  int type_table_cap;
+  int type_table_used;
+
+  // コード生成
+  int labelseq;         // 関数の中での制御構文のラベルの通し番号
+  CodegenStats cg;      // コード生成中の関数の統計
+  FuncCost fcost;       // コード生成中の関数のコスト
+  int loop_depth;       // コード生成中のループのネストの深さ
+  double loop_weight;   // コード生成中の命令のコストに掛ける重み
+  int ncounters;        // コード生成中の関数で使ったカウンタの数
+  long *prof_counts;    // コード生成中の関数の計測結果。NULL なら計測結果がない
+  int prof_ncounts;
+  char *funcname;       // コード生成中の関数の名前
+
+  // エラーが起きたときに compile() に戻るためのジャンプ先
+  jmp_buf jmpbuf;
+};
+
+// 現在のスレッドでコンパイル中のコンパイラ。コンパイル中でなければ NULL
+extern _Thread_local Compiler *cc;
+
+// 目的：cc->filename (または cc->user_input) をコンパイルして cc->out にアセンブリを書き出す。
+// エラーがあれば cc->err にメッセージを書いて 1 を、なければ 0 を返す。exit はしない。
+// compile : Compiler -> int
+int compile(Compiler *c);
+
+
+
+//
+// コマンドラインのドライバー (main.c)
+//
+
+// 目的：コマンドラインの引数どおりにファイルをコンパイルし、終了ステータスを返す。
+// 引数が正しくないときもエラーメッセージを表示して 1 を返し、exit はしない
+// driver_main : int -> char ** -> int
+int driver_main(int argc, char **argv);
+
+//
+// コンパイルサーバー (server.c)
+//
 
+// 目的：Unix ドメインソケット path で待ち受け、クライアントの要求を1つずつ処理し続ける
+int serve(char *path);
+// 目的：サーバーに引数を送ってコンパイルしてもらい、その終了ステータスを返す。
+// サーバーにつながらなければ、この場でコンパイルする
+int client(char *path, int argc, char **argv);
@@ -0,0 +1,107 @@
+#include "9cc.h"
+
+// アリーナ。大きなブロックから小さなオブジェクトを切り出して確保し、まとめて解放する。
+// 使い終わったブロックはプールに取っておき、次のアリーナで使い回せる。
+
+// アリーナのブロックの最小のバイト数
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// 使い終わったブロックを取っておくプール。
+// サーバーモードでは、前の要求で使ったブロックを次の要求のアリーナに使い回す
+static ArenaBlock *arena_pool;
+static size_t arena_pool_size;  // プールにあるブロックのバイト数の合計
+static size_t arena_pool_max;   // プールに取っておくバイト数の上限。0 なら取っておかない
+static pthread_mutex_t arena_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 目的：解放したブロックを max_bytes まではプールに取っておくようにする
+// arena_retain : size_t -> void
+void arena_retain(size_t max_bytes) {
+  arena_pool_max = max_bytes;
+}
+
+// 目的：cap バイトの領域を持つブロックを、プールにあればそこから、なければ新しく確保する
+// new_block : size_t -> ArenaBlock
+static ArenaBlock *new_block(size_t cap) {
+  ArenaBlock *b = NULL;
+  if (cap == ARENA_BLOCK_SIZE && arena_pool_max) {
+    pthread_mutex_lock(&arena_pool_lock);
+    b = arena_pool;
+    if (b) {
+      arena_pool = b->next;
+      arena_pool_size -= b->cap;
+    }
+    pthread_mutex_unlock(&arena_pool_lock);
+  }
+  if (!b)
+    b = malloc(sizeof(ArenaBlock) + cap);
+  b->used = 0;
+  b->cap = cap;
+  return b;
+}
+
+// 目的：ブロックをプールに返す。プールが一杯なら解放する
+// free_block : ArenaBlock -> void
+static void free_block(ArenaBlock *b) {
+  if (b->cap == ARENA_BLOCK_SIZE && arena_pool_max) {
+    pthread_mutex_lock(&arena_pool_lock);
+    bool kept = arena_pool_size + b->cap <= arena_pool_max;
+    if (kept) {
+      b->next = arena_pool;
+      arena_pool = b;
+      arena_pool_size += b->cap;
+    }
+    pthread_mutex_unlock(&arena_pool_lock);
+    if (kept)
+      return;
+  }
+  free(b);
+}
+
+// 目的：0 で埋めた size バイトの領域をアリーナから確保する
+// arena_alloc : Arena -> size_t -> void *
+void *arena_alloc(Arena *a, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+
+  ArenaBlock *b = a->head;
+  if (!b || b->cap - b->used < size) {
+    b = new_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    b->next = a->head;
+    a->head = b;
+  }
+
+  void *p = b->data + b->used;
+  b->used += size;
+  return memset(p, 0, size);
+}
+
+// 目的：s の先頭 len バイトを、'\0' で終わる文字列としてアリーナに複製する
+// arena_strndup : Arena -> char * -> size_t -> char *
+char *arena_strndup(Arena *a, char *s, size_t len) {
+  char *p = arena_alloc(a, len + 1);
+  memcpy(p, s, len);
+  return p;
+}
+
+// 目的：アリーナの中身をすべて捨てる。最後に確保したブロックは次に使うために残す
+// arena_reset : Arena -> void
+void arena_reset(Arena *a) {
+  if (!a->head)
+    return;
+  ArenaBlock *b = a->head->next;
+  while (b) {
+    ArenaBlock *next = b->next;
+    free_block(b);
+    b = next;
+  }
+  a->head->next = NULL;
+  a->head->used = 0;
+}
+
+// 目的：アリーナのブロックをすべて解放する
+// arena_free : Arena -> void
+void arena_free(Arena *a) {
+  arena_reset(a);
+  if (a->head)
+    free_block(a->head);
+  a->head = NULL;
+}
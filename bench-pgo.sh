@@ -0,0 +1,37 @@
+#!/bin/bash
+# -fprofile-use のベンチマーク。
+# 入力のプログラムを -fprofile-generate でコンパイルして実行し、その計測結果を使ってコンパイルし直したものと、
+# 計測結果を使わずにコンパイルしたものを同じように実行して、プログラム自身のコードの中で分岐した回数を比べる。
+# 使い方: ./bench-pgo.sh file...
+set -e
+
+# 目的：実行ファイル $1 の中で、アセンブリ $2 が定義する関数のアドレスの範囲を「開始:終了」の形で並べる
+# 関数の終わりは、アドレスの順で次のシンボルの位置とする
+ranges() {
+    nm -n "$1" | awk -v funcs="$(awk '$1 == ".global" { print $2 }' "$2")" '
+        BEGIN { n = split(funcs, f, "\n"); for (i = 1; i <= n; i++) want[f[i]] = 1 }
+        start != "" { print start ":" $1; start = "" }
+        $3 in want { start = $1 }'
+}
+
+# 目的：実行ファイル $1 (アセンブリは $1.s) を実行し、分岐の数を表示する
+count() {
+    ./branch-count $(ranges "$1" "$1.s") -- "./$1" 2>&1 > /dev/null | sed "s/^/  $2: /"
+}
+
+for src in "$@"; do
+    rm -f tmp.prof
+    ./9cc -fprofile-generate=tmp.prof "$src" > tmp-gen.s
+    gcc -static -o tmp-gen tmp-gen.s
+    ./tmp-gen > /dev/null || true
+
+    ./9cc "$src" > tmp-base.s
+    gcc -static -o tmp-base tmp-base.s
+    ./9cc -fprofile-use=tmp.prof "$src" > tmp-use.s
+    gcc -static -o tmp-use tmp-use.s
+
+    echo "$src:"
+    count tmp-base "without profile"
+    count tmp-use "-fprofile-use  "
+done
+rm -f tmp.prof tmp-gen tmp-gen.s tmp-base tmp-base.s tmp-use tmp-use.s
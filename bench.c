@@ -0,0 +1,60 @@
+// libninecc のベンチマーク。
+// 1つのファイルを読み込んで ninecc_compile で繰り返しコンパイルし、1秒あたりのコンパイル回数を表示する。
+// 最後のコンパイルで得たアセンブリは標準出力に書く。
+// 使い方: ninecc-bench file [回数]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ninecc.h"
+
+// 目的：現在の時刻を秒で返す
+// now : void -> double
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s file [iterations]\n", argv[0]);
+    return 1;
+  }
+  int iters = argc > 2 ? atoi(argv[2]) : 1000;
+
+  FILE *fp = fopen(argv[1], "r");
+  if (!fp) {
+    perror(argv[1]);
+    return 1;
+  }
+  char *src = NULL;
+  size_t len = 0;
+  FILE *mem = open_memstream(&src, &len);
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    fwrite(buf, 1, n, mem);
+  fclose(mem);
+  fclose(fp);
+
+  NineccOptions opts = { .filename = argv[1] };
+  NineccBuffer out = {};
+  double start = now();
+  for (int i = 0; i < iters; i++) {
+    ninecc_buffer_free(&out);
+    if (ninecc_compile(src, len, &opts, &out)) {
+      fwrite(out.errors, 1, out.errors_len, stderr);
+      ninecc_buffer_free(&out);
+      free(src);
+      return 1;
+    }
+  }
+  double elapsed = now() - start;
+
+  fwrite(out.data, 1, out.len, stdout);
+  fprintf(stderr, "%d compiles in %.3f s (%.0f compiles/sec)\n", iters, elapsed, iters / elapsed);
+  ninecc_buffer_free(&out);
+  free(src);
+  return 0;
+}
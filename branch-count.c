@@ -0,0 +1,108 @@
+// 実行した分岐の数を数えるツール。-fprofile-use のベンチマーク (bench-pgo.sh) で使う。
+// プログラムを ptrace で1命令ずつ実行し、条件分岐 (jcc) が実行された回数と分岐した回数、
+// 無条件のジャンプ (jmp) の回数を数えて、標準エラー出力に書く。
+// 範囲を指定すると、命令のアドレスがいずれかの範囲に入る分岐だけを数える。
+// 静的リンクしたプログラムでは、libc の中の分岐を除いてプログラム自身のコードだけを比べられる。
+// 使い方: branch-count [開始:終了]... -- program [引数...]   (アドレスは16進数)
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// アドレスの範囲 [start, end)
+typedef struct {
+  unsigned long start;
+  unsigned long end;
+} Range;
+
+static Range *ranges;
+static int nranges;
+
+// 目的：アドレス addr を数える対象にするかどうかを返す。範囲を指定していなければすべて数える
+// in_ranges : unsigned long -> bool
+static bool in_ranges(unsigned long addr) {
+  if (nranges == 0)
+    return true;
+  for (int i = 0; i < nranges; i++)
+    if (ranges[i].start <= addr && addr < ranges[i].end)
+      return true;
+  return false;
+}
+
+// 目的：命令の先頭のバイト列 insn が条件分岐なら命令の長さを、無条件のジャンプなら -1 を、どちらでもなければ 0 を返す
+// 9cc が吐き出す分岐は接頭辞のない rel8 と rel32 の形だけなので、それ以外 (間接ジャンプなど) は見ない
+// branch_kind : unsigned char * -> int
+static int branch_kind(unsigned char *insn) {
+  if (0x70 <= insn[0] && insn[0] <= 0x7f)
+    return 2;
+  if (insn[0] == 0x0f && 0x80 <= insn[1] && insn[1] <= 0x8f)
+    return 6;
+  if (insn[0] == 0xeb || insn[0] == 0xe9)
+    return -1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int i = 1;
+  ranges = calloc(argc, sizeof(Range));
+  for (; i < argc && strcmp(argv[i], "--"); i++) {
+    if (sscanf(argv[i], "%lx:%lx", &ranges[nranges].start, &ranges[nranges].end) != 2) {
+      fprintf(stderr, "%s: 範囲が正しくありません: %s\n", argv[0], argv[i]);
+      return 1;
+    }
+    nranges++;
+  }
+  if (i + 1 >= argc) {
+    fprintf(stderr, "usage: %s [start:end]... -- program [args...]\n", argv[0]);
+    return 1;
+  }
+  char **prog = argv + i + 1;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    execv(prog[0], prog);
+    perror(prog[0]);
+    _exit(127);
+  }
+
+  // exec の直後で止まる
+  int status;
+  waitpid(pid, &status, 0);
+
+  long conds = 0, taken = 0, jumps = 0;
+  for (;;) {
+    struct user_regs_struct regs;
+    ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+    unsigned long rip = regs.rip;
+    int kind = 0;
+    if (in_ranges(rip)) {
+      long word = ptrace(PTRACE_PEEKTEXT, pid, (void *)rip, NULL);
+      kind = branch_kind((unsigned char *)&word);
+    }
+
+    ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL);
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+      break;
+
+    if (kind > 0) {
+      conds++;
+      ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+      if (regs.rip != rip + kind)
+        taken++;
+    } else if (kind < 0) {
+      jumps++;
+    }
+  }
+
+  fprintf(stderr, "conditional: %ld, taken: %ld, jmp: %ld, taken branches: %ld\n",
+          conds, taken, jumps, taken + jumps);
+  free(ranges);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
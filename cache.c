@@ -0,0 +1,214 @@
+#include "9cc.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+// コンパイル結果のキャッシュ。
+// 入力のバイト列、コンパイラ自身、出力に影響するフラグのハッシュ値をキーにして、
+// キャッシュのディレクトリに <キー>.s という名前でアセンブリを保存する。
+// 書き込みは一時ファイルに書いてから rename するので、
+// 並行に動く複数の 9cc が同じディレクトリを使っても、読み手が書きかけのファイルを見ることはない。
+
+// 128ビットの FNV-1a ハッシュ。
+// 大きな入力や出力全体をハッシュするので、1バイトずつではなく8バイトずつ混ぜ込む
+#define FNV128_PRIME (((Hash)1 << 88) | 0x13b)
+
+// 目的：バイト列 p をハッシュ値 h に混ぜ込んだ値を返す
+// hash_update : Hash -> void * -> size_t -> Hash
+Hash hash_update(Hash h, void *p, size_t len) {
+  unsigned char *s = p;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, s + i, 8);
+    h = (h ^ w) * FNV128_PRIME;
+  }
+  for (; i < len; i++)
+    h = (h ^ s[i]) * FNV128_PRIME;
+  return h;
+}
+
+// 目的：ハッシュの初期値を返す
+// hash_init : void -> Hash
+Hash hash_init(void) {
+  return ((Hash)0x6c62272e07bb0142 << 64) | 0x62b821756295c58d;
+}
+
+static pthread_once_t compiler_hash_once = PTHREAD_ONCE_INIT;
+static Hash compiler_hash_value;
+
+// 目的：実行中のコンパイラの実行ファイルのハッシュ値を求める。
+// コンパイラを作り直すと、それまでのキャッシュは使われなくなる。
+// 実行ファイルを読めないときは、ビルドした日時で代用する。
+// init_compiler_hash : void -> void
+static void init_compiler_hash(void) {
+  Hash h = hash_init();
+
+  FILE *fp = fopen("/proc/self/exe", "r");
+  if (!fp) {
+    compiler_hash_value = hash_update(h, __DATE__ " " __TIME__, sizeof(__DATE__ " " __TIME__));
+    return;
+  }
+
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    h = hash_update(h, buf, n);
+  fclose(fp);
+  compiler_hash_value = h;
+}
+
+// 目的：実行中のコンパイラのハッシュ値を返す
+// compiler_hash : void -> Hash
+Hash compiler_hash(void) {
+  pthread_once(&compiler_hash_once, init_compiler_hash);
+  return compiler_hash_value;
+}
+
+// 目的：入力とフラグに対応するキャッシュのキーを、32文字の16進の文字列で返す
+// cache_key : char * -> size_t -> char * -> char *
+char *cache_key(char *input, size_t len, char *flags) {
+  Hash h = hash_update(compiler_hash(), flags, strlen(flags) + 1);
+  h = hash_update(h, &len, sizeof(len));
+  h = hash_update(h, input, len);
+
+  char *key = malloc(33);
+  sprintf(key, "%016lx%016lx", (unsigned long)(h >> 64), (unsigned long)h);
+  return key;
+}
+
+// 目的：キーに対応するキャッシュのファイルのパスを返す
+// entry_path : char * -> char * -> char *
+static char *entry_path(char *dir, char *key) {
+  char *path;
+  if (asprintf(&path, "%s/%s.s", dir, key) < 0)
+    error("out of memory");
+  return path;
+}
+
+// 目的：キーに対応するアセンブリがキャッシュにあれば out に書き出して true を返す。
+// 使ったエントリは更新時刻を今にして、追い出されにくくする。
+// cache_lookup : char * -> char * -> FILE -> bool
+bool cache_lookup(char *dir, char *key, FILE *out) {
+  char *path = entry_path(dir, key);
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    free(path);
+    return false;
+  }
+
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    fwrite(buf, 1, n, out);
+  fclose(fp);
+
+  utime(path, NULL);
+  free(path);
+  return true;
+}
+
+// 目的：キーに対応するアセンブリをキャッシュに保存する。
+// 一時ファイルに書いてから rename するので、途中までしか書かれていないエントリは見えない。
+// 保存できなくてもコンパイルは失敗させない。
+// cache_store : char * -> char * -> char * -> size_t -> void
+void cache_store(char *dir, char *key, char *buf, size_t len) {
+  mkdir(dir, 0777);
+
+  char *path = entry_path(dir, key);
+  char *tmp;
+  if (asprintf(&tmp, "%s/%s.tmp.%d.%lx", dir, key, getpid(), (unsigned long)pthread_self()) < 0)
+    error("out of memory");
+
+  FILE *fp = fopen(tmp, "w");
+  if (fp) {
+    bool ok = fwrite(buf, 1, len, fp) == len;
+    ok = !fclose(fp) && ok;
+    if (!ok || rename(tmp, path))
+      remove(tmp);
+  }
+
+  free(tmp);
+  free(path);
+}
+
+// キャッシュのエントリ
+typedef struct {
+  char *path;
+  time_t mtime;
+  off_t size;
+} Entry;
+
+// 目的：qsort で使う、エントリを古い順に並べるための比較関数
+// compare_mtime : void * -> void * -> int
+static int compare_mtime(const void *a, const void *b) {
+  const Entry *x = a;
+  const Entry *y = b;
+  if (x->mtime != y->mtime)
+    return x->mtime < y->mtime ? -1 : 1;
+  return strcmp(x->path, y->path);
+}
+
+// 目的：キャッシュの大きさが max_bytes を超えていれば、使われていない順にエントリを消す。
+// 消したエントリの数を返す。途中で終わった書き込みの一時ファイルも、古ければ消す。
+// cache_evict : char * -> long -> int
+int cache_evict(char *dir, long max_bytes) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return 0;
+
+  Entry *entries = NULL;
+  int n = 0, cap = 0;
+  long total = 0;
+  time_t now = time(NULL);
+
+  for (struct dirent *de; (de = readdir(d));) {
+    char *name = de->d_name;
+    bool is_entry = strlen(name) == 34 && !strcmp(name + 32, ".s");
+    bool is_tmp = strstr(name, ".tmp.") != NULL;
+    if (!is_entry && !is_tmp)
+      continue;
+
+    // メモリが足りなければ、そこまでに見たエントリだけで消すものを決める
+    char *path;
+    if (asprintf(&path, "%s/%s", dir, name) < 0)
+      break;
+    struct stat st;
+    if (stat(path, &st)) {
+      free(path);
+      continue;
+    }
+
+    // 1時間以上前の一時ファイルは、異常終了した書き手が残したもの
+    if (is_tmp) {
+      if (now - st.st_mtime > 3600)
+        remove(path);
+      free(path);
+      continue;
+    }
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 256;
+      entries = realloc(entries, cap * sizeof(Entry));
+    }
+    entries[n++] = (Entry){ path, st.st_mtime, st.st_size };
+    total += st.st_size;
+  }
+  closedir(d);
+
+  qsort(entries, n, sizeof(Entry), compare_mtime);
+
+  int evicted = 0;
+  for (int i = 0; i < n; i++) {
+    // 他のプロセスがすでに消していても構わない
+    if (total > max_bytes) {
+      remove(entries[i].path);
+      total -= entries[i].size;
+      evicted++;
+    }
+    free(entries[i].path);
+  }
+  free(entries);
+  return evicted;
+}
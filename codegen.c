@@ -1,13 +1,489 @@
 #include "9cc.h"
+#include <stdatomic.h>
 
 static char *argreg1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 static char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 
-static int labelseq = 1;
-static char *funcname;
-
 static void gen(Node *node);
 
+// 命令のおおまかな種類。--codegen-stats と --cost-report で数える
+typedef enum {
+  INSN_NONE,   // 命令ではない (ラベルやディレクティブ)
+  INSN_OTHER,  // メモリを読み書きしない、その他の命令
+  INSN_PUSH,
+  INSN_POP,
+  INSN_CALL,
+  INSN_RET,
+  INSN_JUMP,   // jmp と条件分岐
+  INSN_LOAD,   // メモリから読む命令
+  INSN_STORE,  // メモリに書く命令
+  INSN_RMW,    // メモリから読んで、計算した結果を同じ場所に書く命令 (inc [rax] など)
+} InsnClass;
+
+// 目的：吐き出したアセンブリの1行 line (長さ len) の命令の種類を返し、*op と *oplen にニーモニックを入れる。
+// 命令は2文字の空白で字下げしてあり、ディレクティブは "." で、ラベルは字下げなしで始まる
+// classify_insn : char * -> int -> char ** -> int * -> InsnClass
+static InsnClass classify_insn(char *line, int len, char **op, int *oplen) {
+  if (len < 3 || strncmp(line, "  ", 2) || line[2] == '.' || line[2] == '\n')
+    return INSN_NONE;
+
+  *op = line + 2;
+  char *end = line + len;
+  char *p = *op;
+  while (p < end && *p != ' ' && *p != '\n')
+    p++;
+  int n = *oplen = p - *op;
+
+  if (n == 4 && !strncmp(*op, "push", 4))
+    return INSN_PUSH;
+  if (n == 3 && !strncmp(*op, "pop", 3))
+    return INSN_POP;
+  if (n == 4 && !strncmp(*op, "call", 4))
+    return INSN_CALL;
+  if (n == 3 && !strncmp(*op, "ret", 3))
+    return INSN_RET;
+  if (**op == 'j')
+    return INSN_JUMP;
+
+  // lea はアドレスを計算するだけでメモリは読まない
+  char *mem = memchr(p, '[', end - p);
+  if (!mem || (n == 3 && !strncmp(*op, "lea", 3)))
+    return INSN_OTHER;
+
+  // 最初のオペランドがメモリなら、mov は書くだけ、cmp と test は読むだけで、
+  // inc や add などはそこから読んで書き戻す
+  char *comma = memchr(p, ',', end - p);
+  if (comma && mem > comma)
+    return INSN_LOAD;
+  if (!strncmp(*op, "mov", 3))
+    return INSN_STORE;
+  if ((n == 3 && !strncmp(*op, "cmp", 3)) || (n == 4 && !strncmp(*op, "test", 4)))
+    return INSN_LOAD;
+  return INSN_RMW;
+}
+
+// 目的：アセンブリの1行 line (長さ len) が命令なら、その種類を s に数える
+// count_insn : CodegenStats -> char * -> int -> void
+static void count_insn(CodegenStats *s, char *line, int len) {
+  char *op;
+  int oplen;
+  InsnClass k = classify_insn(line, len, &op, &oplen);
+  if (k == INSN_NONE)
+    return;
+
+  s->insns++;
+  if (k == INSN_PUSH)
+    s->pushes++;
+  else if (k == INSN_POP)
+    s->pops++;
+  else if (k == INSN_CALL)
+    s->calls++;
+  else if (k == INSN_JUMP)
+    s->branches++;
+  else if (k == INSN_LOAD)
+    s->loads++;
+  else if (k == INSN_STORE)
+    s->stores++;
+  else if (k == INSN_RMW) {
+    s->loads++;
+    s->stores++;
+  }
+}
+
+// 目的：前回の出力から再利用した関数のアセンブリを1行ずつ数える。
+// フレームの大きさは、プロローグの最初の "sub rsp, N" から読む
+// count_text : CodegenStats -> char * -> size_t -> void
+static void count_text(CodegenStats *s, char *text, size_t len) {
+  *s = (CodegenStats){};
+  char *end = text + len;
+  for (char *line = text; line < end;) {
+    char *nl = memchr(line, '\n', end - line);
+    char *next = nl ? nl + 1 : end;
+    count_insn(s, line, next - line);
+    if (!s->frame_size && !strncmp(line, "  sub rsp, ", 11))
+      s->frame_size = atoi(line + 11);
+    line = next;
+  }
+}
+
+// 目的：関数のコードの統計を、JSON の1行として cc->stats_out に書き出す
+// print_codegen_stats : Function -> void
+static void print_codegen_stats(Function *fn) {
+  if (fn->asm_text)
+    count_text(&fn->cg, fn->asm_text, fn->asm_len);
+
+  CodegenStats *s = &fn->cg;
+  FILE *fp = cc->stats_out;
+  fprintf(fp, "{\"file\":");
+  write_json_string(fp, cc->filename);
+  fprintf(fp, ",\"function\":");
+  write_json_string(fp, fn->name);
+  fprintf(fp, ",\"insns\":%d,\"push_pop_pairs\":%d,\"loads\":%d,\"stores\":%d,"
+          "\"branches\":%d,\"calls\":%d,\"frame_size\":%d}\n",
+          s->insns, s->pushes < s->pops ? s->pushes : s->pops, s->loads, s->stores,
+          s->branches, s->calls, s->frame_size);
+}
+
+// 静的なコストモデル。
+// 命令ごとのおおよそのサイクル数を足し合わせて、基本ブロック、ループ、関数のコストを見積もる。
+// 基本ブロックの中で直前の命令が書いたレジスタ (またはフラグ) を読む命令は、その結果を待つのでレイテンシだけかかり、
+// 読まない命令は前の命令と並行に実行できるので逆スループットだけかかるとみなす。
+// 実行回数はわからないので、ループの中の命令は、ネストの深さごとに10回実行されるとみなす。
+
+// 命令のおおよそのサイクル数
+typedef struct {
+  double latency;      // 結果が使えるようになるまでのサイクル数
+  double throughput;   // 逆スループット。依存のない同じ命令を続けて実行するときの、1命令あたりのサイクル数
+} InsnCost;
+
+// 命令ごとのおおよそのサイクル数。一般的な x86-64 のコアでの値を丸めたもの。
+// 表にない命令は種類ごとのサイクル数 (insn_cost) とする
+static struct {
+  char *op;
+  InsnCost cost;
+} insn_cost_table[] = {
+  { "idiv", { 40, 24 } },
+  { "imul", { 3, 1 } },
+};
+
+// 目的：種類が k でニーモニックが op (長さ oplen) の命令の、おおよそのサイクル数を返す
+// insn_cost : InsnClass -> char * -> int -> InsnCost
+static InsnCost insn_cost(InsnClass k, char *op, int oplen) {
+  switch (k) {
+  case INSN_CALL:
+  case INSN_RET:
+    return (InsnCost){ 5, 2 };
+  case INSN_POP:
+  case INSN_LOAD:
+    return (InsnCost){ 4, 0.5 };
+  case INSN_RMW:    // 読んで、計算して、書き戻す
+    return (InsnCost){ 6, 1 };
+  case INSN_STORE:
+    return (InsnCost){ 1, 1 };
+  case INSN_JUMP:
+    return (InsnCost){ 1, 0.5 };
+  default:
+    break;
+  }
+
+  for (int i = 0; i < sizeof(insn_cost_table) / sizeof(*insn_cost_table); i++)
+    if (strlen(insn_cost_table[i].op) == oplen && !strncmp(op, insn_cost_table[i].op, oplen))
+      return insn_cost_table[i].cost;
+  return (InsnCost){ 1, 0.25 };
+}
+
+// 依存を調べるレジスタの名前と、それを含む64ビットのレジスタの名前。
+// rsp は push と pop のたびに変わるが、CPU のスタックエンジンが処理するので依存とはみなさない
+static char *reg_names[][2] = {
+  { "rax", "rax" }, { "al", "rax" },
+  { "rdi", "rdi" }, { "dil", "rdi" },
+  { "rsi", "rsi" }, { "sil", "rsi" },
+  { "rdx", "rdx" }, { "dl", "rdx" },
+  { "rcx", "rcx" }, { "cl", "rcx" },
+  { "r8", "r8" }, { "r8b", "r8" },
+  { "r9", "r9" }, { "r9b", "r9" },
+  { "rbx", "rbx" }, { "r12", "r12" }, { "r13", "r13" }, { "r14", "r14" }, { "rbp", "rbp" },
+};
+
+// 目的：name (長さ len) がレジスタなら、それを含む64ビットのレジスタの名前を、そうでなければ NULL を返す
+// reg64 : char * -> int -> char *
+static char *reg64(char *name, int len) {
+  for (int i = 0; i < sizeof(reg_names) / sizeof(*reg_names); i++)
+    if (strlen(reg_names[i][0]) == len && !strncmp(name, reg_names[i][0], len))
+      return reg_names[i][1];
+  return NULL;
+}
+
+// 目的：オペランドの並び [p, end) の中に、レジスタ reg (またはその一部) があるかどうかを返す
+// mentions_reg : char * -> char * -> char * -> bool
+static bool mentions_reg(char *p, char *end, char *reg) {
+  while (p < end) {
+    if (!isalnum(*p) && *p != '_' && *p != '.') {
+      p++;
+      continue;
+    }
+    char *q = p;
+    while (q < end && (isalnum(*q) || *q == '_' || *q == '.'))
+      q++;
+    char *r = reg64(p, q - p);
+    if (r && !strcmp(r, reg))
+      return true;
+    p = q;
+  }
+  return false;
+}
+
+// 目的：命令 (種類 k、ニーモニック op、オペランドの並び [args, end)) が、
+// 直前の命令の書いたレジスタ prev を読むかどうかを返し、*def に自分が書くレジスタを入れる。
+// フラグは "flags" という名前のレジスタとして、push で書いたスタックの先頭は "stack" という名前のレジスタとして扱う
+// insn_deps : InsnClass -> char * -> int -> char * -> char * -> char * -> char ** -> bool
+static bool insn_deps(InsnClass k, char *op, int oplen, char *args, char *end, char *prev, char **def) {
+  char *comma = memchr(args, ',', end - args);
+  char *first_end = comma ? comma : end;
+  char *first = args;
+  while (first < first_end && *first == ' ')
+    first++;
+  char *first_reg = memchr(first, '[', first_end - first) ? NULL : reg64(first, first_end - first);
+
+  // 書くレジスタ。メモリに書く命令とジャンプは、レジスタを書かないとみなす
+  bool is_cmp = (oplen == 3 && !strncmp(op, "cmp", 3)) || (oplen == 4 && !strncmp(op, "test", 4));
+  if (k == INSN_PUSH)
+    *def = "stack";
+  else if (k == INSN_CALL)
+    *def = "rax";
+  else if (is_cmp)
+    *def = "flags";
+  else if (oplen == 4 && !strncmp(op, "idiv", 4))
+    *def = "rax";
+  else if (oplen == 3 && !strncmp(op, "cqo", 3))
+    *def = "rdx";
+  else if (k == INSN_STORE || k == INSN_RMW || k == INSN_JUMP || k == INSN_RET)
+    *def = NULL;
+  else
+    *def = first_reg;
+
+  if (!prev)
+    return false;
+
+  // pop は直前の push が書いた値を、ストアフォワーディングで読む
+  if (!strcmp(prev, "stack"))
+    return k == INSN_POP;
+
+  // 条件分岐と set は、フラグを読む
+  if (!strcmp(prev, "flags"))
+    return (*op == 'j' && !(oplen == 3 && !strncmp(op, "jmp", 3))) || !strncmp(op, "set", 3);
+
+  // idiv と cqo は rax と rdx を暗に読む
+  if ((oplen == 4 && !strncmp(op, "idiv", 4)) || (oplen == 3 && !strncmp(op, "cqo", 3)))
+    if (!strcmp(prev, "rax") || !strcmp(prev, "rdx"))
+      return true;
+
+  // mov、lea、set と pop は、最初のオペランドのレジスタに書くだけで、読まない
+  bool write_only = !strncmp(op, "mov", 3) || !strncmp(op, "set", 3) || k == INSN_POP ||
+                    (oplen == 3 && !strncmp(op, "lea", 3));
+  if (write_only && first_reg)
+    return mentions_reg(first_end, end, prev);
+  return mentions_reg(args, end, prev);
+}
+
+// 目的：今の基本ブロックを閉じて、そのコストを関数のコストに反映する
+// close_block : void -> void
+static void close_block(void) {
+  FuncCost *c = &cc->fcost;
+  if (c->block == 0)
+    return;
+  c->blocks++;
+  if (c->block_max < c->block)
+    c->block_max = c->block;
+  c->block = 0;
+  c->last_def = NULL;
+}
+
+// 目的：アセンブリの1行 line (長さ len) のコストを数える。
+// 基本ブロックは、ラベルで始まり、ジャンプか ret で終わる
+// count_cost : char * -> int -> void
+static void count_cost(char *line, int len) {
+  if (len >= 2 && line[len - 2] == ':') {
+    close_block();
+    return;
+  }
+
+  char *op;
+  int oplen;
+  InsnClass k = classify_insn(line, len, &op, &oplen);
+  if (k == INSN_NONE)
+    return;
+
+  // オペランドの並びは、ニーモニックの後から行末まで
+  char *args = op + oplen;
+  char *end = line + len;
+  if (end > args && end[-1] == '\n')
+    end--;
+
+  char *def;
+  InsnCost ic = insn_cost(k, op, oplen);
+  bool dep = insn_deps(k, op, oplen, args, end, cc->fcost.last_def, &def);
+  cc->fcost.last_def = def;
+
+  double cycles = (dep ? ic.latency : ic.throughput) * cc->loop_weight;
+  cc->fcost.cost += cycles;
+  cc->fcost.block += cycles;
+  if (oplen == 4 && !strncmp(op, "idiv", 4))
+    cc->fcost.divs++;
+  if (k == INSN_JUMP || k == INSN_RET)
+    close_block();
+}
+
+// 目的：ループの始まりを記録し、中の命令の重みを10倍にする。
+// 返り値は cost_loop_end に渡す。見積もらないときは -1 を返す
+// cost_loop_begin : Node -> int
+static int cost_loop_begin(Node *node) {
+  if (!cc->cost)
+    return -1;
+
+  FuncCost *c = &cc->fcost;
+  if (c->nloops == c->loops_cap) {
+    c->loops_cap = c->loops_cap ? c->loops_cap * 2 : 8;
+    c->loops = realloc(c->loops, c->loops_cap * sizeof(LoopCost));
+  }
+  cc->loop_depth++;
+  cc->loop_weight *= 10;
+
+  // ループの終わりで差を取るために、今までのコストと idiv の数を覚えておく
+  c->loops[c->nloops] = (LoopCost){ node->tok, cc->loop_depth, c->cost, c->divs };
+  return c->nloops++;
+}
+
+// 目的：ループの終わりを記録し、重みを元に戻す
+// cost_loop_end : int -> void
+static void cost_loop_end(int i) {
+  if (i < 0)
+    return;
+  LoopCost *loop = &cc->fcost.loops[i];
+  loop->cost = cc->fcost.cost - loop->cost;
+  loop->divs = cc->fcost.divs - loop->divs;
+  cc->loop_depth--;
+  cc->loop_weight /= 10;
+}
+
+// 1つの関数のコスト。ストリーミングモードでは関数は解放されるので、名前は複製して持つ
+typedef struct {
+  char *name;
+  FuncCost cost;
+} FuncCostEntry;
+
+// 1回のコンパイルで見積もった関数のコスト
+struct CostReport {
+  FuncCostEntry *fns;
+  int nfns;
+  int fns_cap;
+};
+
+// 表示する関数とループの数
+#define COST_REPORT_TOP 10
+
+// 目的：コストの見積もりを始める
+// cost_begin : void -> void
+void cost_begin(void) {
+  cc->cost = calloc(1, sizeof(CostReport));
+}
+
+// 目的：関数のコストを記録する。ループの配列は記録に移す
+// cost_record : Function -> void
+static void cost_record(Function *fn) {
+  CostReport *r = cc->cost;
+  if (r->nfns == r->fns_cap) {
+    r->fns_cap = r->fns_cap ? r->fns_cap * 2 : 64;
+    r->fns = realloc(r->fns, r->fns_cap * sizeof(FuncCostEntry));
+  }
+  r->fns[r->nfns++] = (FuncCostEntry){ strdup(fn->name), fn->cost };
+  fn->cost = (FuncCost){};
+}
+
+// 目的：qsort で使う、関数をコストの高い順に並べるための比較関数
+// compare_fn_cost : void * -> void * -> int
+static int compare_fn_cost(const void *a, const void *b) {
+  double x = ((FuncCostEntry *)a)->cost.cost;
+  double y = ((FuncCostEntry *)b)->cost.cost;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// 表示のために並べ替えるループ
+typedef struct {
+  char *fn;
+  LoopCost *loop;
+} LoopRef;
+
+// 目的：qsort で使う、ループをコストの高い順に並べるための比較関数
+// compare_loop_cost : void * -> void * -> int
+static int compare_loop_cost(const void *a, const void *b) {
+  double x = ((LoopRef *)a)->loop->cost;
+  double y = ((LoopRef *)b)->loop->cost;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// 目的：見積もったコストの高い関数とループを out に表示する
+// cost_print : FILE -> void
+void cost_print(FILE *out) {
+  CostReport *r = cc->cost;
+  qsort(r->fns, r->nfns, sizeof(FuncCostEntry), compare_fn_cost);
+
+  fprintf(out, "cost report for %s (estimated cycles, x10 per loop nesting level):\n", cc->filename);
+  fprintf(out, "  hottest functions:\n");
+  fprintf(out, "  %12s %7s %10s  %s\n", "cycles", "blocks", "max block", "function");
+  for (int i = 0; i < r->nfns && i < COST_REPORT_TOP; i++) {
+    FuncCost *c = &r->fns[i].cost;
+    fprintf(out, "  %12.0f %7d %10.0f  %s\n", c->cost, c->blocks, c->block_max, r->fns[i].name);
+  }
+
+  int n = 0;
+  for (int i = 0; i < r->nfns; i++)
+    n += r->fns[i].cost.nloops;
+  LoopRef *loops = calloc(n, sizeof(LoopRef));
+  n = 0;
+  for (int i = 0; i < r->nfns; i++)
+    for (int j = 0; j < r->fns[i].cost.nloops; j++)
+      loops[n++] = (LoopRef){ r->fns[i].name, &r->fns[i].cost.loops[j] };
+  qsort(loops, n, sizeof(LoopRef), compare_loop_cost);
+
+  fprintf(out, "  hottest loops:\n");
+  fprintf(out, "  %12s %7s  %s\n", "cycles", "depth", "location");
+  for (int i = 0; i < n && i < COST_REPORT_TOP; i++) {
+    LoopCost *loop = loops[i].loop;
+    fprintf(out, "  %12.0f %7d  %s:%d in %s", loop->cost, loop->depth,
+            cc->filename, tok_line(loop->tok), loops[i].fn);
+    if (loop->divs)
+      fprintf(out, " (%d idiv)", loop->divs);
+    fprintf(out, "\n");
+  }
+  free(loops);
+}
+
+// 目的：見積もったコストを解放する
+// cost_free : void -> void
+void cost_free(void) {
+  CostReport *r = cc->cost;
+  if (!r)
+    return;
+  for (int i = 0; i < r->nfns; i++) {
+    free(r->fns[i].name);
+    free(r->fns[i].cost.loops);
+  }
+  free(r->fns);
+  free(r);
+  cc->cost = NULL;
+}
+
+// 目的：printf と同じ引数を取り、アセンブリを出力先 cc->out に書き出す
+// emit : char * -> ... -> void
+static void emit(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (!cc->stats_out && !cc->cost) {
+    vfprintf(cc->out, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  // 命令を数えるときは、書式ではなく書き出す行そのものからニーモニックを読む
+  char *buf;
+  int len = vasprintf(&buf, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    error("out of memory");
+  for (char *line = buf, *end = buf + len; line < end;) {
+    char *nl = memchr(line, '\n', end - line);
+    char *next = nl ? nl + 1 : end;
+    if (cc->stats_out)
+      count_insn(&cc->cg, line, next - line);
+    if (cc->cost)
+      count_cost(line, next - line);
+    line = next;
+  }
+  fwrite(buf, 1, len, cc->out);
+  free(buf);
+}
+
 // 目的：Nodeのポインタを受け取り、スタックにそのアドレスを push する
 // gen_addr : *Node -> アセンブリコードの吐き出し
 static void gen_addr(Node *node) {
@@ -17,11 +493,11 @@ static void gen_addr(Node *node) {
     // 変数がローカル変数の場合、変数用のアドレスを確保する
     // lea dest, [src] : [src]内のアドレス値がそのまま dest に読み出される。
     if (var->is_local) { 
-    printf("  lea rax, [rbp-%d]\n", node->var->offset);
-    printf("  push rax\n");
+    emit("  lea rax, [rbp-%d]\n", node->var->offset);
+    emit("  push rax\n");
     } else {
       // 変数がグローバル変数の場合。
-      printf("  push offset %s\n", var->name);
+      emit("  push offset %s\n", var->name);
     }
     return;
   }
@@ -30,9 +506,9 @@ static void gen_addr(Node *node) {
     return;
   case ND_MEMBER:
     gen_addr(node->lhs);
-    printf("  pop rax\n");
-    printf("  add rax, %d\n", node->member->offset);
-    printf("  push rax\n");
+    emit("  pop rax\n");
+    emit("  add rax, %d\n", node->member->offset);
+    emit("  push rax\n");
     return;
   }
 
@@ -49,28 +525,189 @@ static void gen_lval(Node *node) {
 
 // 目的：メモリから値をロードしてスタックに push する
 static void load(Type *ty) {
-  printf("  pop rax\n");
+  emit("  pop rax\n");
   if (ty->size == 1)
-    printf("  movsx rax, byte ptr [rax]\n");
+    emit("  movsx rax, byte ptr [rax]\n");
   else
-    printf("  mov rax, [rax]\n");
-  printf("  push rax\n");
+    emit("  mov rax, [rax]\n");
+  emit("  push rax\n");
 }
 
 // 目的：メモリに値を格納する
 static void store(Type *ty) {
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
+  emit("  pop rdi\n");
+  emit("  pop rax\n");
 
   if (ty->size == 1)
-    printf("  mov [rax], dil\n");
+    emit("  mov [rax], dil\n");
   else
-    printf("  mov [rax], rdi\n");
+    emit("  mov [rax], rdi\n");
 
-  printf("  push rdi\n");
+  emit("  push rdi\n");
 }
 
 
+// 目的：デバッグ情報を吐き出すときは、node の先頭の行と桁を .loc で記録する
+// emit_loc : Node -> void
+static void emit_loc(Node *node) {
+  if (cc->debug_info)
+    emit("  .loc 1 %d %d\n", tok_line(node->tok), tok_column(node->tok));
+}
+
+// 目的：文を1つ吐き出す。コードを持たない文 (ブロックと初期値のない宣言) 以外は位置を記録する
+// gen_stmt : Node -> アセンブリコードの吐き出し
+static void gen_stmt(Node *node) {
+  if (node->kind != ND_BLOCK && node->kind != ND_NULL)
+    emit_loc(node);
+  gen(node);
+}
+
+// 計測用のコード (-fprofile-generate)。
+// 関数ごとに 8 バイトのカウンタの表 .L.prof.fn.<関数名> を用意し、0 番目に関数が呼ばれた回数を、
+// 続けて分岐ごとに、条件を評価した回数と条件が真だった回数を数える。
+// 分岐の番号は gen() が分岐を吐き出す順につけるので、計測しないときも同じ番号になる。
+
+// 目的：カウンタ i を 1 増やすコードを吐き出す
+// prof_count : int -> void
+static void prof_count(int i) {
+  emit("  inc QWORD PTR [rip+.L.prof.fn.%s+%d]\n", cc->funcname, i * 8);
+}
+
+// 目的：条件を評価した直後 (値を rax に pop したところ) で、分岐に番号をつけ、評価した回数を数える。
+// 返り値は分岐の1つ目のカウンタの番号で、prof_taken に渡す
+// prof_branch : void -> int
+static int prof_branch(void) {
+  int i = cc->ncounters;
+  cc->ncounters += 2;
+  if (cc->prof_gen)
+    prof_count(i);
+  return i;
+}
+
+// 目的：条件が真のときの経路の先頭で、真だった回数を数える
+// prof_taken : int -> void
+static void prof_taken(int i) {
+  if (cc->prof_gen)
+    prof_count(i + 1);
+}
+
+// 目的：計測結果 (-fprofile-use) のカウンタ i の値を返す。計測結果がなければ -1 を返す
+// prof_get : int -> long
+static long prof_get(int i) {
+  if (!cc->prof_counts || i >= cc->prof_ncounts)
+    return -1;
+  return cc->prof_counts[i];
+}
+
+// 目的：if 文のコードを吐き出す。else があれば if ... else、ないときは else のない if としてコンパイルする
+// 計測結果 (-fprofile-use) があれば、よく通る方を分岐の直後に置き、あまり通らない方を関数の外に追い出す。
+// 追い出した方は、通るときだけ2回分岐し (行きと帰り)、よく通る方は1回も分岐しない。
+// 追い出した方は .text の後ろ (サブセクション 1) に、計測で一度も通らなかったなら .text.unlikely に置く。
+// gen_if : Node -> アセンブリコードの吐き出し
+static void gen_if(Node *node) {
+  int seq = cc->labelseq++;
+  gen(node->cond);
+  emit("  pop rax\n");
+  int br = prof_branch();
+  emit("  cmp rax, 0\n");
+
+  // else のない if で then を追い出すと、then を通る割合を p として分岐の回数は 1-p から 2p になる。
+  // p が 1/3 より小さいときだけ追い出す
+  long evals = prof_get(br);
+  long taken = prof_get(br + 1);
+  bool known = evals > 0 && taken >= 0;
+  bool out_then = known && (node->els ? taken < evals - taken : taken * 3 < evals);
+  bool out_else = known && node->els && evals - taken < taken;
+
+  if (!out_then && !out_else) {
+    if (node->els) {
+      emit("  je  .L.else.%s.%d\n", cc->funcname, seq);
+      prof_taken(br);
+      gen_stmt(node->then);
+      emit("  jmp .L.end.%s.%d\n", cc->funcname, seq);
+      emit(".L.else.%s.%d:\n", cc->funcname, seq);
+      gen_stmt(node->els);
+    } else {
+      emit("  je  .L.end.%s.%d\n", cc->funcname, seq);
+      prof_taken(br);
+      gen_stmt(node->then);
+    }
+    emit(".L.end.%s.%d:\n", cc->funcname, seq);
+    return;
+  }
+
+  // 分岐の直後に置く方 (else のない if で then を追い出すときは NULL) と、追い出す方
+  Node *hot = out_then ? node->els : node->then;
+  Node *cold = out_then ? node->then : node->els;
+  char *label = out_then ? "then" : "else";
+  long count = out_then ? taken : evals - taken;
+
+  if (out_then) {
+    emit("  jne .L.then.%s.%d\n", cc->funcname, seq);
+  } else {
+    emit("  je  .L.else.%s.%d\n", cc->funcname, seq);
+    prof_taken(br);
+  }
+  if (hot)
+    gen_stmt(hot);
+  emit(".L.end.%s.%d:\n", cc->funcname, seq);
+
+  if (count)
+    emit(".pushsection .text, 1\n");
+  else
+    emit(".pushsection .text.unlikely\n");
+  emit(".L.%s.%s.%d:\n", label, cc->funcname, seq);
+  if (out_then)
+    prof_taken(br);
+  gen_stmt(cold);
+  emit("  jmp .L.end.%s.%d\n", cc->funcname, seq);
+  emit(".popsection\n");
+}
+
+// 目的：while 文のコードを吐き出す。ループの見積もりの状態を gen のフレームに置かないように分けてある
+// gen_while : Node -> アセンブリコードの吐き出し
+static void gen_while(Node *node) {
+  int seq = cc->labelseq++;
+  int loop = cost_loop_begin(node);
+  emit(".L.begin.%s.%d:\n", cc->funcname, seq);
+  emit_loc(node->cond);
+  gen(node->cond);
+  emit("  pop rax\n");
+  int br = prof_branch();
+  emit("  cmp rax, 0\n");
+  emit("  je  .L.end.%s.%d\n", cc->funcname, seq);
+  prof_taken(br);
+  gen_stmt(node->then);
+  emit("  jmp .L.begin.%s.%d\n", cc->funcname, seq);
+  cost_loop_end(loop);
+  emit(".L.end.%s.%d:\n", cc->funcname, seq);
+}
+
+// 目的：for 文のコードを吐き出す
+// gen_for : Node -> アセンブリコードの吐き出し
+static void gen_for(Node *node) {
+  int seq = cc->labelseq++;
+  if (node->init)
+    gen_stmt(node->init);
+  int loop = cost_loop_begin(node);
+  emit(".L.begin.%s.%d:\n", cc->funcname, seq);
+  if (node->cond) {
+    emit_loc(node->cond);
+    gen(node->cond);
+    emit("  pop rax\n");
+    int br = prof_branch();
+    emit("  cmp rax, 0\n");
+    emit("  je  .L.end.%s.%d\n", cc->funcname, seq);
+    prof_taken(br);
+  }
+  gen_stmt(node->then);
+  if (node->inc)
+    gen_stmt(node->inc);
+  emit("  jmp .L.begin.%s.%d\n", cc->funcname, seq);
+  cost_loop_end(loop);
+  emit(".L.end.%s.%d:\n", cc->funcname, seq);
+}
+
 // 目的：Node のポインタを受け取り、スタックマシンの要領でアセンブリコードを吐き出す
 // gen : Node -> アセンブリコードの吐き出し
 static void gen (Node *node) {
@@ -78,11 +715,11 @@ static void gen (Node *node) {
   case ND_NULL:
     return;
   case ND_NUM:
-    printf("  push %ld\n", node->val);
+    emit("  push %ld\n", node->val);
     return;
   case ND_EXPR_STMT:
     gen(node->lhs);
-    printf("  add rsp, 8\n");
+    emit("  add rsp, 8\n");
     return;
   case ND_VAR:
   case ND_MEMBER:
@@ -103,63 +740,19 @@ static void gen (Node *node) {
     if (node->ty->kind != TY_ARRAY)
       load(node->ty);
     return;
-  case ND_IF: {
-    int seq = labelseq++;
-    // もし else があれば if ... else、ないときは else のない if としてコンパイルする
-    if (node->els) {
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je  .L.else.%d\n", seq);
-      gen(node->then);
-      printf("  jmp .L.end.%d\n", seq);
-      printf(".L.else.%d:\n", seq);
-      gen(node->els);
-      printf(".L.end.%d:\n", seq);
-    } else {
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je  .L.end.%d\n", seq);
-      gen(node->then);
-      printf(".L.end.%d:\n", seq);
-    }
+  case ND_IF:
+    gen_if(node);
     return;
-  }
-  case ND_WHILE: {
-    int seq = labelseq++;
-    printf(".L.begin.%d:\n", seq);
-    gen(node->cond);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je  .L.end.%d\n", seq);
-    gen(node->then);
-    printf("  jmp .L.begin.%d\n", seq);
-    printf(".L.end.%d:\n", seq);
+  case ND_WHILE:
+    gen_while(node);
     return;
-  }
-  case ND_FOR: {
-    int seq = labelseq++;
-    if (node->init)
-      gen(node->init);
-    printf(".L.begin.%d:\n", seq);
-    if (node->cond) {
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je  .L.end.%d\n", seq);
-    }
-    gen(node->then);
-    if (node->inc)
-      gen(node->inc);
-    printf("  jmp .L.begin.%d\n", seq);
-    printf(".L.end.%d:\n", seq);
+  case ND_FOR:
+    gen_for(node);
     return;
-  }
   case ND_BLOCK:
   case ND_STMT_EXPR:
     for (Node *n = node->body; n; n = n->next)
-      gen(n);
+      gen_stmt(n);
     return;
   case ND_FUNCALL: {
     int nargs = 0;
@@ -169,30 +762,30 @@ static void gen (Node *node) {
     }
 
     for (int i = nargs - 1; i >= 0; i--)
-      printf("  pop %s\n", argreg8[i]);
+      emit("  pop %s\n", argreg8[i]);
     
     // 関数を呼ぶ前に RSP を16バイトの倍数にする。ABI規約。
     // RAXは複数個の引数をとる関数用に 0 にセットする。
-    int seq = labelseq++;
-    printf("  mov rax, rsp\n");
-    printf("  and rax, 15\n");
-    printf("  jnz .L.call.%d\n", seq);
-    printf("  mov rax, 0\n");
-    printf("  call %s\n", node->funcname);
-    printf("  jmp .L.end.%d\n", seq);
-    printf(".L.call.%d:\n", seq);
-    printf("  sub rsp, 8\n");
-    printf("  mov rax, 0\n");
-    printf("  call %s\n", node->funcname);
-    printf("  add rsp, 8\n");
-    printf(".L.end.%d:\n", seq);
-    printf("  push rax\n");
+    int seq = cc->labelseq++;
+    emit("  mov rax, rsp\n");
+    emit("  and rax, 15\n");
+    emit("  jnz .L.call.%s.%d\n", cc->funcname, seq);
+    emit("  mov rax, 0\n");
+    emit("  call %s\n", node->funcname);
+    emit("  jmp .L.end.%s.%d\n", cc->funcname, seq);
+    emit(".L.call.%s.%d:\n", cc->funcname, seq);
+    emit("  sub rsp, 8\n");
+    emit("  mov rax, 0\n");
+    emit("  call %s\n", node->funcname);
+    emit("  add rsp, 8\n");
+    emit(".L.end.%s.%d:\n", cc->funcname, seq);
+    emit("  push rax\n");
     return;
   }
   case ND_RETURN:
     gen(node->lhs);
-    printf("  pop rax\n");
-    printf("  jmp .L.return.%s\n", funcname);
+    emit("  pop rax\n");
+    emit("  jmp .L.return.%s\n", cc->funcname);
     return;
   }
 
@@ -200,80 +793,266 @@ static void gen (Node *node) {
   gen(node->lhs);
   gen(node->rhs);
 
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
+  emit("  pop rdi\n");
+  emit("  pop rax\n");
 
   switch (node->kind) {
   case ND_ADD:  // num + num
-    printf("  add rax, rdi\n");
+    emit("  add rax, rdi\n");
     break;
   case ND_PTR_ADD:  // ptr + num || num + ptr
-    printf("  imul rdi, %d\n", node->ty->base->size);  // imul : 積
-    printf("  add rax, rdi\n");
+    emit("  imul rdi, %d\n", node->ty->base->size);  // imul : 積
+    emit("  add rax, rdi\n");
     break;
   case ND_SUB:  // num - num
-    printf("  sub rax, rdi\n");
+    emit("  sub rax, rdi\n");
     break;
   case ND_PTR_SUB:  // ptr - num
-    printf("  imul rdi, %d\n", node->ty->base->size);
-    printf("  sub rax, rdi\n");
+    emit("  imul rdi, %d\n", node->ty->base->size);
+    emit("  sub rax, rdi\n");
     break;
   case ND_PTR_DIFF:
-    printf("  sub rax, rdi\n");
-    printf("  cqo\n");
-    printf("  mov rdi, %d\n", node->lhs->ty->base->size);
-    printf("  idiv rdi\n");
+    emit("  sub rax, rdi\n");
+    emit("  cqo\n");
+    emit("  mov rdi, %d\n", node->lhs->ty->base->size);
+    emit("  idiv rdi\n");
     break;
   case ND_MUL:
-    printf("  imul rax, rdi\n");
+    emit("  imul rax, rdi\n");
     break;
   case ND_DIV:
-    printf("  cqo\n");
-    printf("  idiv rdi\n");
+    emit("  cqo\n");
+    emit("  idiv rdi\n");
     break;
   case ND_EQ:
-    printf("  cmp rax, rdi\n");
-    printf("  sete al\n");
-    printf("  movzb rax, al\n");
+    emit("  cmp rax, rdi\n");
+    emit("  sete al\n");
+    emit("  movzb rax, al\n");
     break;
   case ND_NE:
-    printf("  cmp rax, rdi\n");
-    printf("  setne al\n");
-    printf("  movzb rax, al\n");
+    emit("  cmp rax, rdi\n");
+    emit("  setne al\n");
+    emit("  movzb rax, al\n");
     break;
   case ND_LT:
-    printf("  cmp rax, rdi\n");
-    printf("  setl al\n");
-    printf("  movzb rax, al\n");
+    emit("  cmp rax, rdi\n");
+    emit("  setl al\n");
+    emit("  movzb rax, al\n");
     break;
   case ND_LE:
-    printf("  cmp rax, rdi\n");
-    printf("  setle al\n");
-    printf("  movzb rax, al\n");
+    emit("  cmp rax, rdi\n");
+    emit("  setle al\n");
+    emit("  movzb rax, al\n");
     break;
   }
 
-  printf("  push rax\n");
+  emit("  push rax\n");
+}
+
+// 目的：文字列リテラルの中身が途中に '\0' を含むかどうかを調べる
+// has_inner_nul : Var -> bool
+static bool has_inner_nul(Var *var) {
+  return memchr(var->contents, '\0', var->cont_len - 1) != NULL;
+}
+
+// .ascii 1行あたりに出力する最大のバイト数
+#define ASCII_RUN 64
+
+// 目的：バイト列を1行の文字列として出力する。表示できない文字は8進エスケープにする。
+// 文字列は命令ではないので emit を通さず、エスケープのいらない部分はまとめて書き出す
+// print_quoted : char * -> int -> void
+static void print_quoted(char *p, int len) {
+  FILE *out = cc->out;
+  fputc('"', out);
+  int start = 0;
+  for (int i = 0; i < len; i++) {
+    unsigned char c = p[i];
+    if (' ' <= c && c <= '~' && c != '"' && c != '\\')
+      continue;
+
+    fwrite(p + start, 1, i - start, out);
+    if (c == '"' || c == '\\') {
+      char esc[] = { '\\', c };
+      fwrite(esc, 1, sizeof(esc), out);
+    } else {
+      char esc[] = { '\\', '0' + (c >> 6), '0' + (c >> 3 & 7), '0' + (c & 7) };
+      fwrite(esc, 1, sizeof(esc), out);
+    }
+    start = i + 1;
+  }
+  fwrite(p + start, 1, len - start, out);
+  fputc('"', out);
+}
+
+// 目的：文字列リテラルのグローバル変数を1つ吐き出す
+// 中身は .ascii の行にまとめ、最後の行は終端文字を付ける .string にする。
+// emit_string : Var -> void
+static void emit_string(Var *var) {
+  emit("%s:\n", var->name);
+
+  // contents は終端していないことがあるので、終端文字は .string に付けさせる
+  int len = var->cont_len - 1;
+  int i = 0;
+  for (; len - i > ASCII_RUN; i += ASCII_RUN) {
+    emit("  .ascii ");
+    print_quoted(var->contents + i, ASCII_RUN);
+    emit("\n");
+  }
+  emit("  .string ");
+  print_quoted(var->contents + i, len - i);
+  emit("\n");
 }
 
 // 目的：グローバル変数を吐き出す
 // emit_data : Program -> void
 static void emit_data(Program *prog) {
-  printf(".data\n");
+  // 初期値を持たないグローバル変数は .bss に置き、ファイルの大きさを増やさないようにする
+  emit(".bss\n");
 
   for (VarList *vl = prog->globals; vl; vl = vl->next) {
     Var *var = vl->var;
-    printf("%s:\n", var->name);
-
-    if (!var->contents) {
-      printf("  .zero %d\n", var->ty->size);
+    if (var->contents)
       continue;
-    }
+    emit(".type %s, @object\n", var->name);
+    emit(".size %s, %d\n", var->name, var->ty->size);
+    emit("%s:\n", var->name);
+    emit("  .zero %d\n", var->ty->size);
+  }
+
+  // 文字列リテラルは書き換えられないので読み出し専用のセクションに置く。
+  // 途中に '\0' を含まないものは、リンカがオブジェクトファイルをまたいで
+  // 同じ文字列を併合できるように、併合可能な文字列セクションに置く。
+  emit(".section .rodata.str1.1,\"aMS\",@progbits,1\n");
+  for (VarList *vl = prog->globals; vl; vl = vl->next)
+    if (vl->var->contents && !has_inner_nul(vl->var))
+      emit_string(vl->var);
 
-    // 文字列の1文字ずつのバイトを確保する
-    for (int i = 0; i < var->cont_len; i++)
-      printf("  .byte %d\n", var->contents[i]);
+  emit(".section .rodata\n");
+  for (VarList *vl = prog->globals; vl; vl = vl->next)
+    if (vl->var->contents && has_inner_nul(vl->var))
+      emit_string(vl->var);
+}
+
+// 目的：計測用のコードを埋め込んだ関数を覚えておく
+// prof_record : Function -> void
+static void prof_record(Function *fn) {
+  ProfFunc *pf = arena_alloc(&cc->file_arena, sizeof(ProfFunc));
+  *pf = (ProfFunc){ NULL, fn->name, fn->ncounters };
+  if (cc->prof_last)
+    cc->prof_last->next = pf;
+  else
+    cc->prof_fns = pf;
+  cc->prof_last = pf;
+}
+
+// 目的：カウンタの表と、プログラムの終了時にカウンタをファイルに書き出す関数を吐き出す。
+// 書き出す関数は .init_array から atexit() に登録する。ファイルには追記するので、
+// 実行を繰り返したり、複数の翻訳単位をリンクしたりしても、前の結果は消えない。
+// ファイルには関数ごとに「ファイル名 関数名 カウンタの数 カウンタ...」の1行を書く。
+// emit_prof : void -> void
+static void emit_prof(void) {
+  emit(".bss\n");
+  emit(".align 8\n");
+  for (ProfFunc *pf = cc->prof_fns; pf; pf = pf->next) {
+    emit(".L.prof.fn.%s:\n", pf->name);
+    emit("  .zero %d\n", pf->ncounters * 8);
+  }
+
+  // 関数ごとに { 名前, カウンタの表, カウンタの数 } を並べ、0 で終える
+  emit(".data\n");
+  emit(".align 8\n");
+  emit(".L.prof.table:\n");
+  for (ProfFunc *pf = cc->prof_fns; pf; pf = pf->next)
+    emit("  .quad .L.prof.name.%s, .L.prof.fn.%s, %d\n", pf->name, pf->name, pf->ncounters);
+  emit("  .quad 0\n");
+
+  emit(".section .rodata.str1.1,\"aMS\",@progbits,1\n");
+  for (ProfFunc *pf = cc->prof_fns; pf; pf = pf->next) {
+    emit(".L.prof.name.%s:\n", pf->name);
+    emit("  .string \"%s\"\n", pf->name);
   }
+  emit(".L.prof.file:\n");
+  emit("  .string ");
+  print_quoted(cc->filename, strlen(cc->filename));
+  emit("\n");
+  emit(".L.prof.path:\n");
+  emit("  .string ");
+  print_quoted(cc->prof_gen, strlen(cc->prof_gen));
+  emit("\n");
+  emit(".L.prof.mode:\n");
+  emit("  .string \"a\"\n");
+  emit(".L.prof.head:\n");
+  emit("  .string \"%%s %%s %%ld\"\n");
+  emit(".L.prof.num:\n");
+  emit("  .string \" %%ld\"\n");
+
+  emit(".section .init_array,\"aw\"\n");
+  emit(".align 8\n");
+  emit("  .quad .L.prof.init\n");
+
+  emit(".text\n");
+  emit(".L.prof.init:\n");
+  emit("  push rbp\n");
+  emit("  mov rbp, rsp\n");
+  emit("  lea rdi, [rip+.L.prof.dump]\n");
+  emit("  call atexit\n");
+  emit("  pop rbp\n");
+  emit("  ret\n");
+
+  // rbx にファイル、r12 に表の今の行、r13 にカウンタの番号を置く。
+  // 4つ push して RSP を16バイトの倍数に保つ
+  emit(".L.prof.dump:\n");
+  emit("  push rbp\n");
+  emit("  mov rbp, rsp\n");
+  emit("  push rbx\n");
+  emit("  push r12\n");
+  emit("  push r13\n");
+  emit("  push r14\n");
+  emit("  lea rdi, [rip+.L.prof.path]\n");
+  emit("  lea rsi, [rip+.L.prof.mode]\n");
+  emit("  call fopen\n");
+  emit("  cmp rax, 0\n");
+  emit("  je  .L.prof.dump.end\n");
+  emit("  mov rbx, rax\n");
+  emit("  lea r12, [rip+.L.prof.table]\n");
+  emit(".L.prof.dump.fn:\n");
+  emit("  cmp QWORD PTR [r12], 0\n");
+  emit("  je  .L.prof.dump.close\n");
+  emit("  mov rdi, rbx\n");
+  emit("  lea rsi, [rip+.L.prof.head]\n");
+  emit("  lea rdx, [rip+.L.prof.file]\n");
+  emit("  mov rcx, [r12]\n");
+  emit("  mov r8, [r12+16]\n");
+  emit("  mov rax, 0\n");
+  emit("  call fprintf\n");
+  emit("  mov r13, 0\n");
+  emit(".L.prof.dump.counter:\n");
+  emit("  cmp r13, [r12+16]\n");
+  emit("  jge .L.prof.dump.next\n");
+  emit("  mov rdi, rbx\n");
+  emit("  lea rsi, [rip+.L.prof.num]\n");
+  emit("  mov rax, [r12+8]\n");
+  emit("  mov rdx, [rax+r13*8]\n");
+  emit("  mov rax, 0\n");
+  emit("  call fprintf\n");
+  emit("  add r13, 1\n");
+  emit("  jmp .L.prof.dump.counter\n");
+  emit(".L.prof.dump.next:\n");
+  emit("  mov rdi, 10\n");
+  emit("  mov rsi, rbx\n");
+  emit("  call fputc\n");
+  emit("  add r12, 24\n");
+  emit("  jmp .L.prof.dump.fn\n");
+  emit(".L.prof.dump.close:\n");
+  emit("  mov rdi, rbx\n");
+  emit("  call fclose\n");
+  emit(".L.prof.dump.end:\n");
+  emit("  pop r14\n");
+  emit("  pop r13\n");
+  emit("  pop r12\n");
+  emit("  pop rbx\n");
+  emit("  pop rbp\n");
+  emit("  ret\n");
 }
 
 // 目的：変数とレジスタのインデックスを受け取り、変数のサイズに応じて引数を各レジスタに入れていく
@@ -281,47 +1060,285 @@ static void emit_data(Program *prog) {
 static void load_arg(Var *var, int idx) {
   int sz = var->ty->size;
   if (sz == 1) {
-    printf("  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
+    emit("  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
   } else {
     assert(sz == 8);
-    printf("  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+    emit("  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+  }
+}
+
+// 目的：関数を1つ吐き出す
+// 制御構文のラベルは関数名と関数内での通し番号 (.L.end.<関数名>.<番号>) にするので、
+// 関数ごとのアセンブリは他の関数と独立に、どの順番で作っても同じになる。
+// emit_function : Function -> void
+static void emit_function(Function *fn) {
+  double start = trace_begin();
+  cc->cg = (CodegenStats){};
+  cc->fcost = (FuncCost){};
+  cc->loop_depth = 0;
+  cc->loop_weight = 1;
+  cc->ncounters = 1;
+  cc->prof_counts = NULL;
+  if (cc->profile)
+    cc->prof_counts = profile_find(cc->profile, cc->filename, fn->name, &cc->prof_ncounts);
+
+  // 計測で一度も呼ばれなかった関数は .text.unlikely に置き、よく通るコードから離す
+  bool cold = prof_get(0) == 0;
+  if (cold)
+    emit(".pushsection .text.unlikely\n");
+  emit(".global %s\n", fn->name);
+  emit(".type %s, @function\n", fn->name);
+  emit("%s:\n", fn->name);
+  cc->funcname = fn->name;
+  if (cc->debug_info)
+    emit("  .loc 1 %d %d\n", tok_line(fn->tok), tok_column(fn->tok));
+  cc->labelseq = 1;
+
+  // プロローグ
+  emit("  push rbp\n"); // 元のベースポインタをスタックに push し保存
+  emit("  mov rbp, rsp\n"); // 保存されたベースポインタを指す rsp の位置にrbp を移動
+  emit("  sub rsp, %d\n", fn->stack_size); // 変数分のメモリを確保
+  if (cc->prof_gen)
+    prof_count(0);
+
+  // スタックに引数を push する
+  int i = 0;
+  for (VarList *vl = fn->params; vl; vl = vl->next)
+    load_arg(vl->var, i++);
+
+  // コードの吐き出し
+  for (Node *node = fn->node; node; node = node->next)
+    gen_stmt(node);
+
+  // エピローグ
+  emit(".L.return.%s:\n", cc->funcname);
+  emit("  mov rsp, rbp\n"); // rsp がリターンアドレスを指すようにする
+  emit("  pop rbp\n"); // rbp に元のベースポインタを書き戻す（＝元のベースポイントを指す）
+  emit("  ret\n"); // 呼び出し元の関数のリターンアドレスを pop し、そのアドレスにジャンプする
+  emit(".size %s, .-%s\n", fn->name, fn->name);
+  if (cold)
+    emit(".popsection\n");
+  cc->cg.frame_size = fn->stack_size;
+  fn->cg = cc->cg;
+  fn->ncounters = cc->ncounters;
+  if (cc->cost) {
+    close_block();
+    fn->cost = cc->fcost;
+  }
+  trace_end("codegen", fn->name, start);
+}
+
+// 目的：関数のアセンブリ text を書き出す。
+// インクリメンタルコンパイルでは、出力の中での位置を索引に記録する
+// write_function : Function -> char * -> size_t -> void
+static void write_function(Function *fn, char *text, size_t len) {
+  long offset = cc->incr ? ftell(cc->out) : 0;
+  fwrite(text, 1, len, cc->out);
+  if (cc->incr)
+    incr_record(fn, offset, len);
+  if (cc->stats_out)
+    print_codegen_stats(fn);
+  if (cc->cost)
+    cost_record(fn);
+  if (cc->prof_gen)
+    prof_record(fn);
+}
+
+// 目的：関数を1つ吐き出す。前回の出力から再利用できる関数は、そのアセンブリをコピーする
+// put_function : Function -> void
+static void put_function(Function *fn) {
+  if (fn->asm_text) {
+    write_function(fn, fn->asm_text, fn->asm_len);
+    return;
+  }
+
+  long offset = cc->incr ? ftell(cc->out) : 0;
+  emit_function(fn);
+  if (cc->incr)
+    incr_record(fn, offset, ftell(cc->out) - offset);
+  if (cc->stats_out)
+    print_codegen_stats(fn);
+  if (cc->cost)
+    cost_record(fn);
+  if (cc->prof_gen)
+    prof_record(fn);
+}
+
+// 1つの関数のコード生成のタスク
+// タスクは呼び出し元のコンパイラの写しを使い、アセンブリとエラーメッセージを自分のバッファに書く。
+typedef struct {
+  Function *fn;
+  Compiler cc;
+  char *buf;
+  size_t len;
+  char *errbuf;
+  size_t errlen;
+  bool failed;
+} FuncTask;
+
+// ワーカースレッドが共有するタスクの列
+typedef struct {
+  FuncTask *tasks;
+  int ntasks;
+  atomic_int next;    // 次に取り出すタスクの添字
+  Compiler *parent;
+} FuncQueue;
+
+// 目的：タスクを1つ実行する
+// run_func_task : FuncTask -> Compiler -> void
+static void run_func_task(FuncTask *t, Compiler *parent) {
+  // 前回の出力から再利用する関数は、書き出すときにコピーする
+  if (t->fn->asm_text)
+    return;
+
+  Compiler *saved = cc;
+  t->cc = *parent;
+  t->cc.out = open_memstream(&t->buf, &t->len);
+  t->cc.err = open_memstream(&t->errbuf, &t->errlen);
+  cc = &t->cc;
+
+  if (!setjmp(t->cc.jmpbuf))
+    emit_function(t->fn);
+  else
+    t->failed = true;
+
+  fclose(t->cc.out);
+  fclose(t->cc.err);
+  cc = saved;
+}
+
+// 目的：タスクがなくなるまで、次のタスクを取り出して実行する
+// codegen_worker : void * -> void *
+static void *codegen_worker(void *arg) {
+  FuncQueue *q = arg;
+  for (;;) {
+    int i = atomic_fetch_add(&q->next, 1);
+    if (i >= q->ntasks)
+      return NULL;
+    run_func_task(&q->tasks[i], q->parent);
   }
 }
 
+// 目的：タスクの出力とエラーメッセージを解放し、tasks も解放する
+// free_tasks : FuncTask * -> int -> void
+static void free_tasks(FuncTask *tasks, int n) {
+  for (int i = 0; i < n; i++) {
+    free(tasks[i].buf);
+    free(tasks[i].errbuf);
+  }
+  free(tasks);
+}
+
+// 目的：関数ごとのアセンブリを nthreads 個のスレッドで並列に作り、ソースの順に連結して吐き出す。
+// 結果は逐次に吐き出した場合と同じになる。
+// emit_text_parallel : Program -> int -> void
+static void emit_text_parallel(Program *prog, int nthreads) {
+  int n = 0;
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    n++;
+  if (nthreads > n)
+    nthreads = n;
+
+  FuncQueue q = {};
+  q.tasks = calloc(n, sizeof(FuncTask));
+  q.ntasks = n;
+  q.parent = cc;
+  int i = 0;
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    q.tasks[i++].fn = fn;
+
+  // このスレッドもワーカーとしてタスクを処理する。
+  // スレッドを作れなかったときは、作ったスレッドが q を使い終わるまで待ってから報告する
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  int started = 1, err = 0;
+  for (; started < nthreads; started++)
+    if ((err = pthread_create(&threads[started], NULL, codegen_worker, &q)))
+      break;
+  if (err)
+    atomic_store(&q.next, n);
+  else
+    codegen_worker(&q);
+  for (int i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (err) {
+    free_tasks(q.tasks, n);
+    error("cannot create thread: %s", strerror(err));
+  }
+
+  // 逐次の場合と同じく、ソースの先頭に最も近い関数のエラーだけを報告する
+  for (int i = 0; i < n; i++) {
+    if (!q.tasks[i].failed)
+      continue;
+    fwrite(q.tasks[i].errbuf, 1, q.tasks[i].errlen, cc->err);
+    free_tasks(q.tasks, n);
+    bail();
+  }
+
+  for (int i = 0; i < n; i++) {
+    Function *fn = q.tasks[i].fn;
+    if (fn->asm_text)
+      write_function(fn, fn->asm_text, fn->asm_len);
+    else
+      write_function(fn, q.tasks[i].buf, q.tasks[i].len);
+  }
+  free_tasks(q.tasks, n);
+}
+
 // 目的：関数ごとのアセンブリコードを吐き出す
+// cc->codegen_threads が 2 以上なら、関数ごとに並列に作る。
 // emit_text : Program -> void
 static void emit_text(Program *prog) {
-  printf(".text\n");
+  emit(".text\n");
 
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    printf(".global %s\n", fn->name);
-    printf("%s:\n", fn->name);
-    funcname = fn->name;
+  if (cc->codegen_threads > 1 && prog->fns && prog->fns->next) {
+    emit_text_parallel(prog, cc->codegen_threads);
+    return;
+  }
 
-    // プロローグ
-    printf("  push rbp\n"); // 元のベースポインタをスタックに push し保存
-    printf("  mov rbp, rsp\n"); // 保存されたベースポインタを指す rsp の位置にrbp を移動
-    printf("  sub rsp, %d\n", fn->stack_size); // 変数分のメモリを確保
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    put_function(fn);
+}
 
-    // スタックに引数を push する
-    int i = 0;
-    for (VarList *vl = fn->params; vl; vl = vl->next)
-      load_arg(vl->var, i++);
+// 目的：デバッグ情報を吐き出すときは、.loc が参照するファイル 1 を宣言する
+// emit_file : void -> void
+static void emit_file(void) {
+  if (!cc->debug_info)
+    return;
+  emit(".file 1 ");
+  print_quoted(cc->filename, strlen(cc->filename));
+  emit("\n");
+}
 
-    // コードの吐き出し
-    for (Node *node = fn->node; node; node = node->next)
-      gen(node);
+// 目的：ストリーミングモードで、関数を吐き出す前の前置きを吐き出す
+// codegen_begin : void -> void
+void codegen_begin(void) {
+  emit(".intel_syntax noprefix\n");
+  emit_file();
+  emit(".text\n");
+}
 
-    // エピローグ
-    printf(".L.return.%s:\n", funcname);
-    printf("  mov rsp, rbp\n"); // rsp がリターンアドレスを指すようにする
-    printf("  pop rbp\n"); // rbp に元のベースポインタを書き戻す（＝元のベースポイントを指す）
-    printf("  ret\n"); // 呼び出し元の関数のリターンアドレスを pop し、そのアドレスにジャンプする
-  }
+// 目的：ストリーミングモードで、パースし終えた関数を1つ吐き出す
+// codegen_function : Function -> void
+void codegen_function(Function *fn) {
+  put_function(fn);
+}
+
+// 目的：ストリーミングモードで、すべての関数の後にグローバル変数をまとめて吐き出す
+// codegen_end : VarList -> void
+void codegen_end(VarList *globals) {
+  Program prog = { .globals = globals };
+  emit_data(&prog);
+  if (cc->prof_gen)
+    emit_prof();
 }
 
 void codegen(Program *prog) {
-  printf(".intel_syntax noprefix\n");
+  emit(".intel_syntax noprefix\n");
+  emit_file();
   emit_data(prog);
   emit_text(prog);
-}
\ No newline at end of file
+  if (cc->prof_gen)
+    emit_prof();
+}
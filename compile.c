@@ -0,0 +1,267 @@
+#include "9cc.h"
+
+// 現在のスレッドでコンパイル中のコンパイラ
+_Thread_local Compiler *cc;
+
+// 目的：指定されたファイルの内容を返す。path が "-" なら標準入力を読む
+// read_file : char * -> char
+static char *read_file(char *path) {
+  // ファイルを開く
+  FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+  
+  // ファイルを読み込む。足りなくなったらバッファを倍に広げる。
+  // トークンの位置は int のオフセットで持つので、INT_MAX バイト以上の入力は扱えない
+  size_t cap = 1024 * 1024;
+  char *buf = malloc(cap);
+  size_t size = 0;
+  for (;;) {
+    // fread (格納先のバッファ、読み込むデータ１つのバイト数、読み込むデータの個数、ファイルポインタ)
+    // 戻り値は、読み込んだデータの大きさ（個数）
+    size += fread(buf + size, 1, cap - size - 2, fp);
+    if (size >= INT_MAX - 1) {
+      free(buf);
+      error("%s: ファイルが大きすぎます (%d バイト未満に限ります)", path, INT_MAX - 1);
+    }
+    if (feof(fp)) // feof : ファイルポインタの位置が EOF か判定する
+      break;
+    if (ferror(fp))
+      error("%s: cannot read: %s", path, strerror(errno));
+    cap *= 2;
+    buf = realloc(buf, cap);
+  }
+  if (fp != stdin)
+    fclose(fp);
+  
+  // ファイルが必ず "\n\0" で終わっているようにする
+  if (size == 0 || buf[size - 1] != '\n')
+    buf[size++] = '\n';
+  buf[size] = '\0';
+  return buf;
+}
+
+int align_to(int n, int align) {
+  return (n + align - 1) & ~(align - 1);
+}
+
+// 目的：1回のコンパイルで使った作業用の配列を解放する
+// release : Compiler -> void
+static void release(Compiler *c) {
+  // エスケープを含む文字列リテラルの中身だけは、入力の外に確保してある
+  for (int i = 0; i < c->tokens.nstrs; i++)
+    if (c->tokens.strs[i].owned)
+      free(c->tokens.strs[i].contents);
+
+  free(c->tokens.kind);
+  free(c->tokens.loc);
+  free(c->tokens.len);
+  free(c->tokens.aux);
+  free(c->tokens.vals);
+  free(c->tokens.strs);
+  c->tokens = (TokenStream){};
+  free(c->line_starts);
+  c->line_starts = NULL;
+  c->nlines = 0;
+  free(c->strlit_table);
+  c->strlit_table = NULL;
+  c->strlit_cap = c->strlit_used = 0;
+  free(c->type_table);
+  c->type_table = NULL;
+  c->type_table_cap = c->type_table_used = 0;
+  arena_free(&c->arena);
+  arena_free(&c->file_arena);
+  incr_free();
+  cost_free();
+}
+
+// 目的：関数のローカル変数にスタック上のオフセットを割り当て、スタックの大きさを決める
+// assign_lvar_offsets : Function -> void
+static void assign_lvar_offsets(Function *fn) {
+  int offset = 0;
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    offset += var->ty->size;
+    var->offset = offset;
+  }
+  fn->stack_size = align_to(offset, 8);
+}
+
+// 目的：関数を1つずつパースし、オフセットを割り当てて吐き出してから、その AST を解放する。
+// メモリの使用量は、ファイル全体ではなく最も大きな関数の AST で決まる。
+// グローバル変数は、すべての関数を吐き出した後にまとめて吐き出す。
+// compile_stream : void -> void
+static void compile_stream(void) {
+  parse_init();
+  codegen_begin();
+  while (!at_eof()) {
+    Timer t = timer_start();
+    Function *fn = toplevel();
+    timer_stop(&t, PHASE_PARSE);
+    if (!fn)
+      continue;
+
+    t = timer_start();
+    assign_lvar_offsets(fn);
+    timer_stop(&t, PHASE_LAYOUT);
+
+    t = timer_start();
+    codegen_function(fn);
+    timer_stop(&t, PHASE_CODEGEN);
+    arena_reset(&cc->arena);
+  }
+
+  Timer t = timer_start();
+  codegen_end(cc->globals);
+  timer_stop(&t, PHASE_CODEGEN);
+}
+
+// 目的：トークン列の配列の大きさを、メモリの使用量として数える
+// count_tokens : void -> void
+static void count_tokens(void) {
+  TokenStream *ts = &cc->tokens;
+  cc->stats.count[MEM_TOKEN] += ts->cnt;
+  cc->stats.bytes[MEM_TOKEN] +=
+    (size_t)ts->cap * (sizeof(*ts->kind) + sizeof(*ts->loc) + sizeof(*ts->len) + sizeof(*ts->aux)) +
+    (size_t)ts->vals_cap * sizeof(*ts->vals) + (size_t)ts->strs_cap * sizeof(*ts->strs);
+}
+
+// 目的：トークン列を作ってパースし、アセンブリを cc->out に吐き出す
+// compile_input : void -> void
+static void compile_input(void) {
+  Timer t = timer_start();
+  cc->token = tokenize();     // トークン列を作り、先頭のトークンの添字を返す
+  timer_stop(&t, PHASE_TOKENIZE);
+  count_tokens();
+
+  if (cc->dump_tokens) {
+    print_tokens(cc->out);
+    return;
+  }
+
+  if (cc->stream) {
+    compile_stream();
+    return;
+  }
+
+  t = timer_start();
+  Program *prog = program();
+  timer_stop(&t, PHASE_PARSE);
+
+  // 関数ごとにオフセットをローカル変数に割り当てる
+  t = timer_start();
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    assign_lvar_offsets(fn);
+  timer_stop(&t, PHASE_LAYOUT);
+
+  // ASTをトラバースして、アセンブリのコードを吐き出す
+  t = timer_start();
+  codegen(prog);
+  timer_stop(&t, PHASE_CODEGEN);
+}
+
+// 目的：結果がキャッシュにあればそれを、なければコンパイルした結果を cc->out に書き出す。
+// コンパイルした結果はキャッシュに保存する。
+// compile_cached : void -> void
+static void compile_cached(void) {
+  // 出力を変えるフラグはキーに含める。デバッグ情報にはファイル名が入るので、そのときはファイル名も含める
+  char *flags;
+  if (asprintf(&flags, "%s%s%s", cc->stream ? "--stream " : "", cc->debug_info ? "-g " : "",
+               cc->debug_info ? cc->filename : "") < 0)
+    error("out of memory");
+  char *key = cache_key(cc->user_input, strlen(cc->user_input), flags);
+  free(flags);
+
+  if (cache_lookup(cc->cache_dir, key, cc->out)) {
+    cc->cache_hit = true;
+    free(key);
+    return;
+  }
+
+  FILE *out = cc->out;
+  cc->out = open_memstream(&cc->out_buf, &cc->out_len);
+  compile_input();
+  fclose(cc->out);
+  cc->out = out;
+
+  fwrite(cc->out_buf, 1, cc->out_len, out);
+  cache_store(cc->cache_dir, key, cc->out_buf, cc->out_len);
+  free(cc->out_buf);
+  cc->out_buf = NULL;
+  free(key);
+}
+
+// 目的：前回の出力から変わっていない関数を再利用しながらコンパイルし、cc->out に書き出す。
+// 今回の出力の索引を、出力の隣に保存する。
+// compile_incremental : void -> void
+static void compile_incremental(void) {
+  incr_load();
+
+  FILE *out = cc->out;
+  cc->out = open_memstream(&cc->out_buf, &cc->out_len);
+  compile_input();
+  fclose(cc->out);
+  cc->out = out;
+
+  fwrite(cc->out_buf, 1, cc->out_len, out);
+  incr_save(cc->out_buf, cc->out_len);
+  free(cc->out_buf);
+  cc->out_buf = NULL;
+  incr_free();
+}
+
+// 目的：c->filename (または c->user_input) をコンパイルして c->out にアセンブリを書き出す。
+// エラーがあれば c->err にメッセージを書いて 1 を、なければ 0 を返す。
+// コンパイル中の状態はすべて c に置くので、スレッドごとに別の Compiler を渡せば並行に呼び出せる。
+// compile : Compiler -> int
+int compile(Compiler *c) {
+  cc = c;
+  c->cache_hit = false;
+  c->funcs_reused = c->funcs_total = 0;
+  c->stats = (Stats){};
+  c->prof_fns = c->prof_last = NULL;
+  FILE *out = c->out;
+
+  // エラーが起きると error() がここに戻ってくる
+  if (setjmp(c->jmpbuf)) {
+    // 出力を貯めていたバッファは捨てる
+    if (c->out != out) {
+      fclose(c->out);
+      free(c->out_buf);
+      c->out_buf = NULL;
+      c->out = out;
+    }
+    release(c);
+    cc = NULL;
+    return 1;
+  }
+
+  if (!c->user_input) {
+    Timer t = timer_start();
+    c->user_input = read_file(c->filename);
+    timer_stop(&t, PHASE_READ);
+  }
+
+  if (c->cost_report)
+    cost_begin();
+
+  // キャッシュから取り出すと関数ごとの統計がとれないので、統計をとるときはキャッシュを使わない。
+  // コストの見積もりには関数の AST が必要なので、前回の出力も再利用しない。
+  // 計測用のコードを埋め込むときや計測結果を使うときと、トークン列を書き出すときは出力が変わるので、
+  // キャッシュも前回の出力も使わない
+  bool changes_output = c->prof_gen || c->profile || c->dump_tokens;
+  if (c->incr_path && !c->cost_report && !changes_output)
+    compile_incremental();
+  else if (c->cache_dir && !c->stats_out && !c->cost_report && !changes_output)
+    compile_cached();
+  else
+    compile_input();
+  fflush(c->out);
+
+  if (c->cost_report)
+    cost_print(c->err);
+
+  release(c);
+  cc = NULL;
+  return 0;
+}
@@ -0,0 +1,184 @@
+#include "9cc.h"
+
+// 関数単位のインクリメンタルコンパイル。
+// 出力 foo.s の隣に索引 foo.s.idx を置き、関数ごとのキーと、foo.s の中での関数のアセンブリの位置を記録する。
+// 次のコンパイルでは、キーが前回と同じ関数はパースもコード生成もせず、前回の foo.s の該当する部分をコピーする。
+
+// 索引のファイルのヘッダ。エントリが nentries 個続く
+typedef struct {
+  char magic[8];        // "9ccidx1"
+  Hash compiler;        // 索引を作ったコンパイラのハッシュ値
+  Hash output;          // 出力 (.s) 全体のハッシュ値
+  uint64_t output_len;  // 出力の大きさ
+  uint64_t nentries;
+} IndexHeader;
+
+// 索引のエントリ。1つの関数に対応する
+typedef struct {
+  Hash key;             // 関数のキー
+  uint64_t offset;      // 出力の中での関数のアセンブリの位置
+  uint64_t len;         // 関数のアセンブリの長さ
+} IndexEntry;
+
+struct Incr {
+  char *path;           // 索引のパス
+
+  // 前回の出力と、キーで並べ替えた索引
+  char *prev;
+  size_t prev_len;
+  IndexEntry *prev_entries;
+  int nprev;
+
+  // 今回の出力の索引
+  IndexEntry *entries;
+  int n;
+  int cap;
+};
+
+static char magic[8] = "9ccidx1";
+
+// 目的：ファイルの中身をすべて読み込んで返す。読めなければ NULL を返す
+// read_all : char * -> size_t * -> char *
+static char *read_all(char *path, size_t *len) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  size_t cap = 65536, n = 0;
+  char *buf = malloc(cap);
+  for (;;) {
+    n += fread(buf + n, 1, cap - n, fp);
+    if (n < cap)
+      break;
+    cap *= 2;
+    buf = realloc(buf, cap);
+  }
+
+  bool ok = !ferror(fp);
+  fclose(fp);
+  if (!ok) {
+    free(buf);
+    return NULL;
+  }
+  *len = n;
+  return buf;
+}
+
+// 目的：qsort と bsearch で使う、エントリをキーで比べる関数
+// compare_key : void * -> void * -> int
+static int compare_key(const void *a, const void *b) {
+  Hash x = ((IndexEntry *)a)->key;
+  Hash y = ((IndexEntry *)b)->key;
+  return x < y ? -1 : x > y;
+}
+
+// 目的：前回の出力とその索引を読み込む。
+// 索引がない、別のコンパイラで作られた、出力が索引を作った後に書き換えられた、
+// のいずれかの場合は、前回の結果を使わずにすべての関数をコンパイルする。
+// incr_load : void -> void
+void incr_load(void) {
+  Incr *incr = calloc(1, sizeof(Incr));
+  cc->incr = incr;
+  if (asprintf(&incr->path, "%s.idx", cc->incr_path) < 0)
+    error("out of memory");
+
+  size_t len;
+  char *buf = read_all(incr->path, &len);
+  if (!buf)
+    return;
+
+  IndexHeader *hdr = (IndexHeader *)buf;
+  if (len < sizeof(IndexHeader) || memcmp(hdr->magic, magic, sizeof(magic)) ||
+      hdr->compiler != compiler_hash() ||
+      len != sizeof(IndexHeader) + hdr->nentries * sizeof(IndexEntry)) {
+    free(buf);
+    return;
+  }
+
+  incr->prev = read_all(cc->incr_path, &incr->prev_len);
+  if (!incr->prev || incr->prev_len != hdr->output_len ||
+      hash_update(hash_init(), incr->prev, incr->prev_len) != hdr->output) {
+    free(incr->prev);
+    incr->prev = NULL;
+    free(buf);
+    return;
+  }
+
+  incr->nprev = hdr->nentries;
+  incr->prev_entries = malloc(incr->nprev * sizeof(IndexEntry));
+  memcpy(incr->prev_entries, buf + sizeof(IndexHeader), incr->nprev * sizeof(IndexEntry));
+  qsort(incr->prev_entries, incr->nprev, sizeof(IndexEntry), compare_key);
+  free(buf);
+}
+
+// 目的：前回の出力に fn と同じキーの関数があれば、そのアセンブリを fn に設定して true を返す
+// incr_lookup : Function -> bool
+bool incr_lookup(Function *fn) {
+  Incr *incr = cc->incr;
+  if (!incr->nprev)
+    return false;
+
+  IndexEntry key = { .key = fn->key };
+  IndexEntry *e = bsearch(&key, incr->prev_entries, incr->nprev, sizeof(IndexEntry), compare_key);
+  if (!e || e->offset + e->len > incr->prev_len)
+    return false;
+
+  fn->asm_text = incr->prev + e->offset;
+  fn->asm_len = e->len;
+  cc->funcs_reused++;
+  return true;
+}
+
+// 目的：今回の出力の中での関数のアセンブリの位置を索引に記録する
+// incr_record : Function -> long -> long -> void
+void incr_record(Function *fn, long offset, long len) {
+  Incr *incr = cc->incr;
+  if (incr->n == incr->cap) {
+    incr->cap = incr->cap ? incr->cap * 2 : 64;
+    incr->entries = realloc(incr->entries, incr->cap * sizeof(IndexEntry));
+  }
+  incr->entries[incr->n++] = (IndexEntry){ fn->key, offset, len };
+  cc->funcs_total++;
+}
+
+// 目的：今回の出力 out の索引を書き出す。
+// 一時ファイルに書いてから rename するので、書きかけの索引が読まれることはない
+// incr_save : char * -> size_t -> void
+void incr_save(char *out, size_t len) {
+  Incr *incr = cc->incr;
+  IndexHeader hdr = {};
+  memcpy(hdr.magic, magic, sizeof(magic));
+  hdr.compiler = compiler_hash();
+  hdr.output = hash_update(hash_init(), out, len);
+  hdr.output_len = len;
+  hdr.nentries = incr->n;
+
+  char *tmp;
+  if (asprintf(&tmp, "%s.tmp", incr->path) < 0)
+    error("out of memory");
+  FILE *fp = fopen(tmp, "w");
+  if (!fp)
+    error("cannot open %s: %s", tmp, strerror(errno));
+
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(incr->entries, sizeof(IndexEntry), incr->n, fp);
+  if (fclose(fp) || rename(tmp, incr->path)) {
+    remove(tmp);
+    error("cannot write %s: %s", incr->path, strerror(errno));
+  }
+  free(tmp);
+}
+
+// 目的：インクリメンタルコンパイルの状態を解放する
+// incr_free : void -> void
+void incr_free(void) {
+  Incr *incr = cc->incr;
+  if (!incr)
+    return;
+  free(incr->path);
+  free(incr->prev);
+  free(incr->prev_entries);
+  free(incr->entries);
+  free(incr);
+  cc->incr = NULL;
+}
@@ -1,55 +1,489 @@
 #include "9cc.h"
+#include <stdatomic.h>
 
-// 目的：指定されたファイルの内容を返す
-// read_file : char * -> char
-static char *read_file(char *path) {
-  // ファイルを開く
-  FILE *fp = fopen(path, "r");
-  if (!fp)
-    error("cannot open %s: %s", path, strerror(errno));
-  
-  // ファイルを読み込む
-  int filemax = 10 * 1024 * 1024;
-  char *buf = malloc(filemax);
-  // fread (格納先のバッファ、読み込むデータ１つのバイト数、読み込むデータの個数、ファイルポインタ)
-  // 戻り値は、読み込んだデータの大きさ（個数）
-  int size = fread(buf, 1, filemax - 2, fp);
-  if (!feof(fp)) // feof : ファイルポインタの位置が EOF か判定する
-    error("%s: file too large");
-  
-  // ファイルが必ず "\n\0" で終わっているようにする
-  if (size == 0 || buf[size - 1] != '\n')
-    buf[size++] = '\n';
-  buf[size] = '\0';
+// 1つの入力ファイルをコンパイルするジョブ
+// ジョブはワーカースレッドで並行に処理し、エラーメッセージは入力の順に表示する。
+typedef struct {
+  char *input;    // 入力ファイルのパス
+  char *output;   // 出力ファイルのパス。NULL なら標準出力に書く
+  char *errbuf;   // エラーメッセージ
+  size_t errlen;
+  char *statsbuf; // 関数ごとのコードの統計
+  size_t statslen;
+  int status;     // compile() の戻り値
+  bool cache_hit; // 結果をキャッシュから取り出したかどうか
+  int funcs_reused; // 前回の出力から再利用した関数の数
+  int funcs_total;  // 関数の数
+  Stats stats;      // フェーズごとの時間とメモリの使用量
+  bool done;      // ジョブが終わったかどうか
+} Job;
+
+static Job *jobs;
+static int njobs;
+static atomic_int next_job;     // 次に取り出すジョブの添字
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static int tokenize_threads = 1;
+static int codegen_threads = 1;
+static bool stream;
+static bool debug_info;
+static bool dump_tokens;
+static char *cache_dir;
+static bool incremental;
+static bool timing;
+static bool cost_report;
+static char *prof_gen;          // 計測したカウンタを書き出すファイル。NULL なら計測用のコードを埋め込まない
+static Profile *profile;        // 読み込んだ計測結果。NULL なら使わない
+static FILE *stats_file;        // 関数ごとのコードの統計の出力先。NULL なら統計をとらない
+
+// 目的：入力ファイルのパスと出力先のディレクトリから、出力ファイルのパスを作る
+// foo/bar.c は dir/bar.s になる。メモリが足りなければ NULL を返す
+// output_path : char * -> char * -> char *
+static char *output_path(char *dir, char *input) {
+  char *base = strrchr(input, '/');
+  base = base ? base + 1 : input;
+  int len = strlen(base);
+  if (len > 2 && !strcmp(base + len - 2, ".c"))
+    len -= 2;
+
+  char *buf;
+  if (asprintf(&buf, "%s/%.*s.s", dir, len, base) < 0)
+    return NULL;
   return buf;
 }
 
-int align_to(int n, int align) {
-  return (n + align - 1) & ~(align - 1);
+// 目的：ジョブを1つ実行する。エラーメッセージはジョブのバッファに書く
+// 出力は一時ファイルに書いてから rename するので、失敗しても前回の出力はそのまま残り、
+// インクリメンタルコンパイルではコンパイル中に前回の出力を読める。
+// run_job : Job -> void
+static void run_job(Job *job) {
+  FILE *err = open_memstream(&job->errbuf, &job->errlen);
+  FILE *stats = stats_file ? open_memstream(&job->statsbuf, &job->statslen) : NULL;
+  char *tmp = NULL;
+  if (job->output && asprintf(&tmp, "%s.tmp", job->output) < 0)
+    tmp = NULL;
+  FILE *out = !job->output ? stdout : tmp ? fopen(tmp, "w") : NULL;
+
+  if (!out) {
+    if (tmp)
+      fprintf(err, "cannot open %s: %s\n", tmp, strerror(errno));
+    else
+      fprintf(err, "%s: out of memory\n", job->input);
+    job->status = 1;
+  } else {
+    Compiler c = {
+      .filename = job->input,
+      .out = out,
+      .err = err,
+      .tokenize_threads = tokenize_threads,
+      .codegen_threads = codegen_threads,
+      .stream = stream,
+      .debug_info = debug_info,
+      .dump_tokens = dump_tokens,
+      .cache_dir = cache_dir,
+      .incr_path = incremental ? job->output : NULL,
+      .stats_out = stats,
+      .timing = timing,
+      .cost_report = cost_report,
+      .prof_gen = prof_gen,
+      .profile = profile,
+    };
+    job->status = compile(&c);
+    job->cache_hit = c.cache_hit;
+    job->funcs_reused = c.funcs_reused;
+    job->funcs_total = c.funcs_total;
+    job->stats = c.stats;
+    free(c.user_input);
+
+    if (job->output) {
+      if (fclose(out) && !job->status) {
+        fprintf(err, "cannot write %s: %s\n", tmp, strerror(errno));
+        job->status = 1;
+      }
+      if (job->status)
+        remove(tmp);
+      else
+        rename(tmp, job->output);
+    }
+  }
+  fclose(err);
+  if (stats)
+    fclose(stats);
+  free(tmp);
+
+  pthread_mutex_lock(&jobs_lock);
+  job->done = true;
+  pthread_cond_broadcast(&job_done);
+  pthread_mutex_unlock(&jobs_lock);
+}
+
+// 目的：ジョブがなくなるまで、次のジョブを取り出して実行する
+// worker : void * -> void *
+static void *worker(void *arg) {
+  for (;;) {
+    int i = atomic_fetch_add(&next_job, 1);
+    if (i >= njobs)
+      return NULL;
+    run_job(&jobs[i]);
+  }
+}
+
+// 目的：ジョブを nthreads 個のワーカースレッドで実行し、エラーメッセージを入力の順に表示する。
+// 1つでも失敗したジョブがあるか、スレッドを作れなかったときは 1 を、そうでなければ 0 を返す
+// run_jobs : int -> int
+static int run_jobs(int nthreads) {
+  if (nthreads > njobs)
+    nthreads = njobs;
+
+  // スレッドを作れなくなったら、それ以上は作らずに、作れたスレッドだけでジョブを実行する。
+  // 1つも作れなければ、このスレッドで実行する
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  int started = 0;
+  int err = threads ? 0 : ENOMEM;
+  while (!err && started < nthreads) {
+    err = pthread_create(&threads[started], NULL, worker, NULL);
+    if (!err)
+      started++;
+  }
+  if (err)
+    fprintf(stderr, "cannot create thread: %s\n", strerror(err));
+  if (started == 0)
+    worker(NULL);
+
+  // 終わった順ではなく入力の順に表示するので、表示は実行の順序によらない
+  int status = err ? 1 : 0;
+  for (int i = 0; i < njobs; i++) {
+    pthread_mutex_lock(&jobs_lock);
+    while (!jobs[i].done)
+      pthread_cond_wait(&job_done, &jobs_lock);
+    pthread_mutex_unlock(&jobs_lock);
+
+    fwrite(jobs[i].errbuf, 1, jobs[i].errlen, stderr);
+    free(jobs[i].errbuf);
+    if (stats_file)
+      fwrite(jobs[i].statsbuf, 1, jobs[i].statslen, stats_file);
+    free(jobs[i].statsbuf);
+    status |= jobs[i].status;
+  }
+
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  return status;
 }
 
+// 目的：ジョブの配列を解放する
+// free_jobs : void -> void
+static void free_jobs(void) {
+  for (int i = 0; i < njobs; i++)
+    free(jobs[i].output);
+  free(jobs);
+  jobs = NULL;
+  njobs = 0;
+}
+
+// 目的：qsort で使う、ジョブを出力先のパスで比べる関数
+// compare_output : void * -> void * -> int
+static int compare_output(const void *a, const void *b) {
+  Job *x = *(Job **)a;
+  Job *y = *(Job **)b;
+  int cmp = strcmp(x->output, y->output);
+  return cmp ? cmp : x - y;
+}
+
+// 使い方: 9cc [--tokenize-threads=N] [--codegen-threads=N] [--stream] [-g] [--dump-tokens]
+//             [--cache-dir=DIR] [--cache-size=N] [--cache-stats] [--incremental]
+//             [--time-report] [--mem-report] [--trace=FILE] [--codegen-stats[=FILE]] [--cost-report]
+//             [-fprofile-generate[=FILE]] [-fprofile-use[=FILE]]
+//             [-j N] [-o dir] file...
+// -o を指定しないときは、ファイルを1つだけ受け取り、アセンブリを標準出力に書く。
+// -o を指定したときは、各ファイルを dir/<名前>.s にコンパイルする。
+// -j N を指定すると、N 個のファイルを並行にコンパイルする。
+// --stream を指定すると、関数を1つずつパースして吐き出し、メモリの使用量を抑える。
+// -g を指定すると、文ごとのソースの行と桁を .loc で吐き出し、アセンブラに行番号の表 (.debug_line) を作らせる。
+// --dump-tokens を指定すると、アセンブリの代わりにトークンの種類、位置、長さと、整数の値や文字列リテラルの中身を書く。
+// --cache-dir=DIR を指定すると、コンパイル結果を DIR にキャッシュし、同じ入力ならそれを使う。
+// キャッシュは --cache-size=N (MB, 既定は 256) を超えると古いものから消す。
+// --cache-stats を指定すると、キャッシュのヒットとミスの数を表示する。
+// --incremental を指定すると、前回の出力 dir/<名前>.s から変わっていない関数のアセンブリを再利用する。
+// 関数ごとのキーは dir/<名前>.s.idx に保存する。
+// --time-report を指定すると、フェーズごとの実時間と CPU 時間を表示する。
+// --mem-report を指定すると、オブジェクトの種類ごとの数とバイト数、最大 RSS を表示する。
+// --trace=FILE を指定すると、フェーズと関数ごとの区間を Chrome のトレースイベントの形式で FILE に書く。
+// --codegen-stats を指定すると、関数ごとの命令の数、push と pop の組の数、メモリの読み書き、
+// ジャンプ、呼び出しの数とフレームの大きさを、JSON Lines の形式で標準エラー出力 (または FILE) に書く。
+// --cost-report を指定すると、命令ごとのサイクル数とループのネストの深さからコストを見積もり、
+// コストの高い関数とループを表示する。
+// -fprofile-generate を指定すると、関数が呼ばれた回数と分岐ごとの条件が真だった回数を数えるコードを埋め込む。
+// 生成したプログラムは、終了するときにカウンタを 9cc.prof (または FILE) に追記する。
+// -fprofile-use を指定すると、9cc.prof (または FILE) の計測結果から、if 文のよく通る方を分岐しない経路にし、
+// 一度も通らなかった if 文の分岐先と呼ばれなかった関数を .text.unlikely に置く。
+// ファイルの名前が - なら標準入力を読む。
+// driver_main : int -> char ** -> int
+int driver_main(int argc, char **argv) {
+  // サーバーモードでは要求ごとに呼ばれるので、前の要求の設定を消しておく
+  tokenize_threads = codegen_threads = 1;
+  stream = debug_info = dump_tokens = incremental = timing = cost_report = false;
+  stats_file = NULL;
+  cache_dir = prof_gen = NULL;
+  next_job = 0;
+
+  char *outdir = NULL;
+  int nthreads = 1;
+  long cache_size = 256L * 1024 * 1024;
+  bool cache_stats = false;
+  bool time_report = false;
+  bool mem_report = false;
+  char *trace_path = NULL;
+  char *stats_path = NULL;
+  char *prof_use = NULL;
+  char **inputs = calloc(argc, sizeof(char *));
+  int ninputs = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--tokenize-threads=", 19)) {
+      tokenize_threads = atoi(argv[i] + 19);
+      continue;
+    }
+    if (!strncmp(argv[i], "--codegen-threads=", 18)) {
+      codegen_threads = atoi(argv[i] + 18);
+      continue;
+    }
+    if (!strcmp(argv[i], "--stream")) {
+      stream = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-g")) {
+      debug_info = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--dump-tokens")) {
+      dump_tokens = true;
+      continue;
+    }
+    if (!strncmp(argv[i], "--cache-dir=", 12)) {
+      cache_dir = argv[i] + 12;
+      continue;
+    }
+    if (!strncmp(argv[i], "--cache-size=", 13)) {
+      cache_size = atol(argv[i] + 13) * 1024 * 1024;
+      continue;
+    }
+    if (!strcmp(argv[i], "--cache-stats")) {
+      cache_stats = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--incremental")) {
+      incremental = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--time-report")) {
+      time_report = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--mem-report")) {
+      mem_report = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--cost-report")) {
+      cost_report = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--codegen-stats")) {
+      stats_path = "-";
+      continue;
+    }
+    if (!strncmp(argv[i], "--codegen-stats=", 16)) {
+      stats_path = argv[i] + 16;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fprofile-generate")) {
+      prof_gen = "9cc.prof";
+      continue;
+    }
+    if (!strncmp(argv[i], "-fprofile-generate=", 19)) {
+      prof_gen = argv[i] + 19;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fprofile-use")) {
+      prof_use = "9cc.prof";
+      continue;
+    }
+    if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+      prof_use = argv[i] + 14;
+      continue;
+    }
+    if (!strncmp(argv[i], "--trace=", 8)) {
+      trace_path = argv[i] + 8;
+      continue;
+    }
+    if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "-o")) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "%s: %s には引数が必要です\n", argv[0], argv[i]);
+        free(inputs);
+        return 1;
+      }
+      if (argv[i][1] == 'j')
+        nthreads = atoi(argv[++i]);
+      else
+        outdir = argv[++i];
+      continue;
+    }
+    if (!strncmp(argv[i], "-j", 2)) {
+      nthreads = atoi(argv[i] + 2);
+      continue;
+    }
+    inputs[ninputs++] = argv[i];
+  }
+
+  char *msg = NULL;
+  if (ninputs == 0 || (!outdir && ninputs > 1))
+    msg = "引数の個数が正しくありません";
+  else if (incremental && !outdir)
+    msg = "--incremental には -o が必要です";
+  if (msg) {
+    fprintf(stderr, "%s: %s\n", argv[0], msg);
+    free(inputs);
+    return 1;
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+
+  jobs = calloc(ninputs, sizeof(Job));
+  njobs = ninputs;
+  for (int i = 0; i < ninputs; i++) {
+    jobs[i].input = inputs[i];
+    if (outdir && !(jobs[i].output = output_path(outdir, inputs[i]))) {
+      fprintf(stderr, "%s: out of memory\n", argv[0]);
+      free_jobs();
+      free(inputs);
+      return 1;
+    }
+  }
+
+  // 出力ファイルが重なると、結果がスレッドの実行順に依存してしまう。
+  // 出力先のパスで並べ替えて、隣り合うものを比べる
+  if (outdir) {
+    Job **sorted = calloc(njobs, sizeof(Job *));
+    for (int i = 0; i < njobs; i++)
+      sorted[i] = &jobs[i];
+    qsort(sorted, njobs, sizeof(Job *), compare_output);
+    bool collided = false;
+    for (int i = 1; i < njobs && !collided; i++) {
+      if (!strcmp(sorted[i - 1]->output, sorted[i]->output)) {
+        fprintf(stderr, "%s: %s と %s の出力先がどちらも %s です\n",
+                argv[0], sorted[i - 1]->input, sorted[i]->input, sorted[i]->output);
+        collided = true;
+      }
+    }
+    free(sorted);
+    if (collided) {
+      free_jobs();
+      free(inputs);
+      return 1;
+    }
+  }
+
+  if (prof_use) {
+    profile = profile_load(prof_use);
+    if (!profile) {
+      fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], prof_use, strerror(errno));
+      free_jobs();
+      free(inputs);
+      return 1;
+    }
+  }
+
+  if (stats_path) {
+    stats_file = strcmp(stats_path, "-") ? fopen(stats_path, "w") : stderr;
+    if (!stats_file) {
+      fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], stats_path, strerror(errno));
+      profile_free(profile);
+      profile = NULL;
+      free_jobs();
+      free(inputs);
+      return 1;
+    }
+  }
+
+  timing = time_report || trace_path;
+  if (trace_path)
+    trace_start();
+
+  int status = run_jobs(nthreads);
+
+  int hits = 0;
+  for (int i = 0; i < njobs; i++)
+    hits += jobs[i].cache_hit;
+
+  // キャッシュが大きくなりすぎていれば、使われていないエントリを消す。
+  // すべてキャッシュから取り出したときはキャッシュは大きくなっていないので、ディレクトリを調べない
+  int evicted = 0;
+  if (cache_dir && hits < njobs)
+    evicted = cache_evict(cache_dir, cache_size);
+
+  if (cache_stats && cache_dir) {
+    fprintf(stderr, "cache: %d hits, %d misses, %d evicted\n", hits, njobs - hits, evicted);
+  }
+
+  if (incremental && cache_stats) {
+    int reused = 0, total = 0;
+    for (int i = 0; i < njobs; i++) {
+      reused += jobs[i].funcs_reused;
+      total += jobs[i].funcs_total;
+    }
+    fprintf(stderr, "incremental: %d of %d functions reused\n", reused, total);
+  }
+
+  // すべてのジョブの計測結果を足し合わせて表示する
+  Stats stats = {};
+  for (int i = 0; i < njobs; i++) {
+    for (int j = 0; j < NUM_PHASES; j++) {
+      stats.wall[j] += jobs[i].stats.wall[j];
+      stats.cpu[j] += jobs[i].stats.cpu[j];
+    }
+    for (int j = 0; j < NUM_MEM_KINDS; j++) {
+      stats.count[j] += jobs[i].stats.count[j];
+      stats.bytes[j] += jobs[i].stats.bytes[j];
+    }
+  }
+  if (time_report)
+    print_time_report(stderr, &stats);
+  if (mem_report)
+    print_mem_report(stderr, &stats);
+
+  if (stats_file && stats_file != stderr && fclose(stats_file)) {
+    fprintf(stderr, "%s: cannot write %s: %s\n", argv[0], stats_path, strerror(errno));
+    status = 1;
+  }
+
+  if (trace_path && !trace_finish(trace_path)) {
+    fprintf(stderr, "%s: cannot write %s: %s\n", argv[0], trace_path, strerror(errno));
+    status = 1;
+  }
+
+  profile_free(profile);
+  profile = NULL;
+  free_jobs();
+  free(inputs);
+  return status;
+}
+
+// 使い方: 9cc --server=SOCKET
+//         9cc --client=SOCKET [driver_main の引数...]
+// --server を指定すると、Unix ドメインソケット SOCKET で待ち受けるコンパイルサーバーになる。
+// --client を指定すると、残りの引数をサーバーに送ってコンパイルしてもらう。
+// 結果は --client を付けずに実行したときと同じで、サーバーが動いていなければその場でコンパイルする。
 int main(int argc, char **argv) {
-  if (argc != 2)
-    error("%s: 引数の個数が正しくありません", argv[0]);
-
-  // Tokenize and parse
-  filename = argv[1];
-  user_input = read_file(argv[1]);
-  token = tokenize();     // トークン列の連結リストを返す。(head.next)
-  Program *prog = program();
-
-  // 関数ごとにオフセットをローカル変数に割り当てる
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    int offset = 0;
-    for (VarList *vl = fn->locals; vl; vl = vl->next) {
-      Var *var = vl->var;
-      offset += var->ty->size;
-      var->offset = offset;
-    }
-    fn->stack_size = align_to(offset, 8);
-  }
-  
-  // ASTをトラバースして、アセンブリのコードを吐き出す
-  codegen(prog);
-  return 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--server=", 9))
+      return serve(argv[i] + 9);
+
+    if (!strncmp(argv[i], "--client=", 9)) {
+      char *path = argv[i] + 9;
+      memmove(argv + i, argv + i + 1, (argc - i) * sizeof(char *));
+      return client(path, argc - 1, argv);
+    }
+  }
+  return driver_main(argc, argv);
 }
@@ -0,0 +1,76 @@
+#include "9cc.h"
+#include "ninecc.h"
+
+// 目的：src の先頭 len バイトをコンパイルし、アセンブリとエラーメッセージを out に返す。
+// 成功したら 0 を、エラーがあれば 1 を返す
+// ninecc_compile : char * -> size_t -> NineccOptions -> NineccBuffer -> int
+int ninecc_compile(const char *src, size_t len, const NineccOptions *opts, NineccBuffer *out) {
+  NineccOptions defaults = {};
+  if (!opts)
+    opts = &defaults;
+
+  // read_file と同じく、トークンの位置を int のオフセットで持つので、INT_MAX バイト以上の入力は扱えない
+  *out = (NineccBuffer){};
+  if (len >= INT_MAX - 1) {
+    char *msg;
+    int n = asprintf(&msg, "%s: 入力が大きすぎます (%d バイト未満に限ります)\n",
+                     opts->filename ? opts->filename : "<input>", INT_MAX - 1);
+    if (n >= 0) {
+      out->errors = msg;
+      out->errors_len = n;
+    }
+    return 1;
+  }
+
+  // read_file と同じく、入力が必ず "\n\0" で終わっているようにする。
+  // トークナイザーは16バイト境界に揃えたブロック単位で読むので、大きさも16バイトの倍数にしておく
+  char *input = malloc((len + 2 + 15) & ~(size_t)15);
+  FILE *asm_out = input ? open_memstream(&out->data, &out->len) : NULL;
+  FILE *err = asm_out ? open_memstream(&out->errors, &out->errors_len) : NULL;
+  if (!err) {
+    if (asm_out)
+      fclose(asm_out);
+    free(out->data);
+    free(input);
+    *out = (NineccBuffer){};
+    return 1;
+  }
+
+  memcpy(input, src, len);
+  if (len == 0 || input[len - 1] != '\n')
+    input[len++] = '\n';
+  input[len] = '\0';
+
+  Compiler c = {
+    .filename = (char *)(opts->filename ? opts->filename : "<input>"),
+    .user_input = input,
+    .out = asm_out,
+    .err = err,
+    .tokenize_threads = 1,
+    .codegen_threads = opts->codegen_threads > 0 ? opts->codegen_threads : 1,
+    .stream = opts->stream,
+    .debug_info = opts->debug_info,
+    .cache_dir = (char *)opts->cache_dir,
+  };
+  int status = compile(&c);
+
+  fclose(asm_out);
+  fclose(err);
+  free(input);
+
+  // 途中まで書いたアセンブリは返さない
+  if (status) {
+    free(out->data);
+    out->data = NULL;
+    out->len = 0;
+  }
+  return status;
+}
+
+// 目的：ninecc_compile が返した結果を解放する
+// ninecc_buffer_free : NineccBuffer -> void
+void ninecc_buffer_free(NineccBuffer *buf) {
+  free(buf->data);
+  free(buf->errors);
+  *buf = (NineccBuffer){};
+}
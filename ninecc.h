@@ -0,0 +1,37 @@
+// 9cc をライブラリとして使うための API (libninecc.a)
+// メモリ上のソースをコンパイルして、アセンブリをメモリ上に返す。
+// ファイルを書いたりプロセスを作ったりせず、エラーがあっても exit しない。
+// コンパイルの状態は呼び出しごとに作って捨てるので、複数のスレッドから並行に呼び出せる。
+#ifndef NINECC_H
+#define NINECC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// コンパイルのオプション。0 で埋めたものが既定値になる
+typedef struct {
+  const char *filename;   // エラーメッセージに表示するファイルの名前。NULL なら "<input>"
+  int codegen_threads;    // コード生成に使うスレッドの数。0 なら 1
+  bool stream;            // 関数を1つずつパースして吐き出し、メモリの使用量を抑える
+  bool debug_info;        // 文ごとのソースの位置 (.file と .loc) を吐き出す
+  const char *cache_dir;  // コンパイル結果のキャッシュのディレクトリ。NULL ならキャッシュを使わない
+} NineccOptions;
+
+// コンパイルの結果
+typedef struct {
+  char *data;             // アセンブリ。'\0' で終わる。失敗したときは NULL
+  size_t len;
+  char *errors;           // エラーメッセージ。'\0' で終わる。なければ空文字列。メモリが足りなければ NULL
+  size_t errors_len;
+} NineccBuffer;
+
+// 目的：src の先頭 len バイトをコンパイルし、アセンブリとエラーメッセージを out に返す。
+// 成功したら 0 を、エラーがあれば 1 を返す。opts が NULL なら既定のオプションを使う。
+// メモリが足りなければ、out を空にして 1 を返す。
+// out は、使い終わったら ninecc_buffer_free で解放する。
+int ninecc_compile(const char *src, size_t len, const NineccOptions *opts, NineccBuffer *out);
+
+// 目的：ninecc_compile が返した結果を解放する
+void ninecc_buffer_free(NineccBuffer *buf);
+
+#endif
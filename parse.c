@@ -1,28 +1,45 @@
 #include "9cc.h"
 
-// ローカル変数の連結リスト。パース中に作られたローカル変数はここに格納される
-static VarList *locals;
-// グローバル変数の連結リスト。
-static VarList *globals;
-
-static VarList *scope;
-
 // 目的：トークン列を受け取り、名前で変数を検索する。見つからなかったらNULLを返す。
-// *find_var : *Token -> Var || NULL
-static Var *find_var(Token *tok) {
-  for (VarList *vl = scope; vl; vl = vl->next) {
+// *find_var : int -> Var || NULL
+static Var *find_var(int tok) {
+  for (VarList *vl = cc->scope; vl; vl = vl->next) {
     Var *var = vl->var;
-    if (strlen(var->name) == tok->len && !strncmp(tok->str, var->name, tok->len))
+    if (strlen(var->name) == cc->tokens.len[tok] && !strncmp(tok_str(tok), var->name, cc->tokens.len[tok]))
       return var;
   }
   return NULL;
 }
 
+// 目的：kind のノードが必要とするバイト数を返す。共通ヘッダ＋kind ごとのフィールド。
+// node_size : NodeKind -> size_t
+static size_t node_size(NodeKind kind) {
+  switch (kind) {
+  case ND_NULL:
+    return offsetof(Node, lhs);
+  case ND_NUM:
+    return offsetof(Node, val) + sizeof(long);
+  case ND_VAR:
+    return offsetof(Node, var) + sizeof(Var *);
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    return offsetof(Node, body) + sizeof(Node *);
+  case ND_IF:
+  case ND_WHILE:
+  case ND_FOR:
+    return sizeof(Node);
+  default:
+    // 演算子、"return"、式文、メンバーアクセス、関数呼び出し
+    return offsetof(Node, rhs) + sizeof(Node *);
+  }
+}
 
 // 目的：Nodeを新しく作る
 // new_node : NodeKind -> Node
-static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+static Node *new_node(NodeKind kind, int tok) {
+  size_t size = node_size(kind);
+  note_alloc(MEM_NODE, size);
+  Node *node = arena_alloc(&cc->arena, size);
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -30,50 +47,57 @@ static Node *new_node(NodeKind kind, Token *tok) {
 
 // 目的：右辺と左辺を持つ2項演算子の Node を作る
 // new_binary : NodeKind -> Node -> Node -> Node
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
+static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, int tok) {
   Node *node = new_node(kind, tok);
   node->lhs = lhs;
   node->rhs = rhs;
+  add_type(node);
   return node;
 }
 
 // 目的：左辺のみを持つ単項演算子の Node を作る
-// new_unary : NodeKind -> Node -> Token -> Node
-static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
+// new_unary : NodeKind -> Node -> int -> Node
+static Node *new_unary(NodeKind kind, Node *expr, int tok) {
   Node *node = new_node(kind, tok);
   node->lhs = expr;
+  add_type(node);
   return node;
 }
 
 // 目的：数値のノードを新しく作る
 // new_num : int -> Node
-static Node *new_num(long val, Token *tok) {
+static Node *new_num(long val, int tok) {
   Node *node = new_node(ND_NUM, tok);
   node->val = val;
+  add_type(node);
   return node;
 }
 
 // 目的：Var 型のポインタを受け取り、変数のノードを新しく作る
 // new_var_node : *Var -> Node
-static Node *new_var_node(Var *var, Token *tok) {
+static Node *new_var_node(Var *var, int tok) {
   Node *node = new_node(ND_VAR, tok);
   node->var = var;
+  add_type(node);
   return node;
 }
 
 // 目的：引数にとった型と名前の変数を新たに作る。ローカル変数かどうかの真偽値も入れる。
 // *new_lvar : char * -> Type -> bool -> Var
 static Var *new_var(char *name, Type *ty, bool is_local) {
-  // 引数の名前と型を持つ変数を作る
-  Var *var = calloc(1, sizeof(Var));
+  // 引数の名前と型を持つ変数を作る。
+  // ローカル変数は関数の AST と一緒にアリーナに置き、グローバル変数はコンパイルが終わるまで残す
+  Arena *arena = is_local ? &cc->arena : &cc->file_arena;
+  note_alloc(MEM_VAR, sizeof(Var));
+  Var *var = arena_alloc(arena, sizeof(Var));
   var->name = name;
   var->ty = ty;
   var->is_local = is_local;
 
-  VarList *sc = calloc(1, sizeof(VarList));
+  VarList *sc = arena_alloc(arena, sizeof(VarList));
   sc->var = var;
-  sc->next = scope;
-  scope = sc;
+  sc->next = cc->scope;
+  cc->scope = sc;
   return var;
 }
 
@@ -82,10 +106,10 @@ static Var *new_var(char *name, Type *ty, bool is_local) {
 static Var *new_lvar(char *name, Type *ty) {
   Var *var = new_var(name, ty, true);
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(&cc->arena, sizeof(VarList));
   vl->var = var;
-  vl->next = locals;
-  locals = vl;
+  vl->next = cc->locals;
+  cc->locals = vl;
   return var;
 }
 
@@ -94,71 +118,232 @@ static Var *new_lvar(char *name, Type *ty) {
 static Var *new_gvar(char *name, Type *ty) {
   Var *var = new_var(name, ty, false);
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(&cc->file_arena, sizeof(VarList));
   vl->var = var;
-  vl->next = globals;
-  globals = vl;
+  vl->next = cc->globals;
+  cc->globals = vl;
   return var;
 }
 
-// 目的：文字列リテラル用のメモリを確保する？
-// new_label : void -> char
-static char *new_label(void) {
-  static int cnt = 0;
-  char buf[20];
-  sprintf(buf, ".L.data.%d", cnt++); // buf に cnt を代入した".L.data.%d"を格納する
-  return strndup(buf, 20);  // buf に格納された文字列を複製して返す
+// 文字列リテラルの intern テーブル（オープンアドレス法）は cc->strlit_table に置く。
+// 中身が同じ文字列リテラルは、1つのグローバル変数（ラベル）を共有する。
+
+// 目的：文字列リテラルの中身のハッシュ値を返す
+// strlit_hash : char * -> int -> Hash
+static Hash strlit_hash(char *p, int len) {
+  return hash_update(hash_init(), p, len);
+}
+
+// 目的：テーブルの容量を倍にして、既存の文字列リテラルを入れ直す
+// grow_strlit_table : void -> void
+static void grow_strlit_table(void) {
+  int cap = cc->strlit_cap ? cc->strlit_cap * 2 : 256;
+  Var **table = calloc(cap, sizeof(Var *));
+
+  for (int i = 0; i < cc->strlit_cap; i++) {
+    Var *var = cc->strlit_table[i];
+    if (!var)
+      continue;
+    int j = (unsigned long)strlit_hash(var->contents, var->cont_len - 1) & (cap - 1);
+    while (table[j])
+      j = (j + 1) & (cap - 1);
+    table[j] = var;
+  }
+
+  free(cc->strlit_table);
+  cc->strlit_table = table;
+  cc->strlit_cap = cap;
+}
+
+// 目的：文字列リテラルの中身に対応するグローバル変数を返す。なければ作って登録する
+// strlit_var : StrLit -> Var
+static Var *strlit_var(StrLit *str) {
+  if (cc->strlit_used * 4 >= cc->strlit_cap * 3)
+    grow_strlit_table();
+
+  // ラベルは中身の128ビットのハッシュ値から作る。出てくる順番によらないので、
+  // 関数のアセンブリは、それより前の関数の文字列リテラルに影響されない
+  Hash h = strlit_hash(str->contents, str->len);
+  char label[56];
+  int len = sprintf(label, ".L.str.%016lx%016lx", (unsigned long)(h >> 64), (unsigned long)h);
+
+  // ハッシュ値が同じになる文字列リテラルは同じ位置から探し始めるので、探す途中で必ず見つかる
+  int same = 0;
+  int i = (unsigned long)h & (cc->strlit_cap - 1);
+  for (Var *var; (var = cc->strlit_table[i]); i = (i + 1) & (cc->strlit_cap - 1)) {
+    if (var->cont_len == str->len + 1 && !memcmp(var->contents, str->contents, str->len))
+      return var;
+    if (!strncmp(var->name, label, len))
+      same++;
+  }
+
+  // 中身が違うのにラベルが同じになったら、番号を付けて区別する
+  if (same)
+    len += sprintf(label + len, ".%d", same);
+
+  Type *ty = array_of(char_type, str->len + 1);
+  Var *var = new_gvar(arena_strndup(&cc->file_arena, label, len), ty);
+  var->contents = str->contents;
+  var->cont_len = str->len + 1;
+  cc->strlit_table[i] = var;
+  cc->strlit_used++;
+  return var;
 }
 
-static Function *function(void);
+static Function *function(char *name, int tok);
 static Type *basetype(void);
 static Type *struct_decl(void);
 static Member *struct_member(void);
-static void global_var(void);
+static void global_var(Type *ty, char *name);
 static Node *declaration(void);
 static bool is_typename(void);
 static Node *stmt(void);
-static Node *stmt2(void);
 static Node *expr(void);
-static Node *assign(void);
-static Node *equality(void);
-static Node *relational(void);
-static Node *add(void);
-static Node *mul(void);
 static Node *unary(void);
 static Node *postfix(void);
 static Node *primary(void);
 
-// 目的： トークンを1つ先読みし、次のトップレベルが関数かグローバル変数かを調べる。
-// is_function : void -> bool
-static bool is_function(void) {
-  Token *tok = token;
-  basetype();
-  bool isfunc = consume_ident() && consume("(");
-  token = tok;
-  return isfunc;
+// 目的：パーサーの状態を、新しいプログラムを読み始めるときの状態にする
+// parse_init : void -> void
+void parse_init(void) {
+  cc->globals = NULL;
+  cc->scope = NULL;
+  cc->globals_hash = hash_init();
+  free(cc->strlit_table);
+  cc->strlit_table = NULL;
+  cc->strlit_cap = cc->strlit_used = 0;
+}
+
+// 目的：トークン列 [start, end) のハッシュ値を h に混ぜ込んだ値を返す
+// 空白やコメントは含めないので、それらだけの変更ではハッシュ値は変わらない。
+// 種類と長さは配列のまままとめて、文字列はバッファに詰めてからまとめてハッシュする。
+// hash_tokens : Hash -> int -> int -> Hash
+static Hash hash_tokens(Hash h, int start, int end) {
+  h = hash_update(h, cc->tokens.kind + start, end - start);
+  h = hash_update(h, cc->tokens.len + start, (end - start) * sizeof(int));
+
+  char buf[4096];
+  int n = 0;
+  for (int tok = start; tok < end; tok++) {
+    int len = cc->tokens.len[tok];
+    if (n + len > sizeof(buf)) {
+      h = hash_update(h, buf, n);
+      n = 0;
+    }
+    if (len > sizeof(buf)) {
+      h = hash_update(h, tok_str(tok), len);
+      continue;
+    }
+    memcpy(buf + n, tok_str(tok), len);
+    n += len;
+  }
+  return hash_update(h, buf, n);
+}
+
+// 目的：トークン列 [start, end) の関数のキーを返す。
+// デバッグ情報を吐き出すときは、アセンブリに文の行と桁が入るので、関数の先頭の位置と、
+// 空白やコメントを含めた関数のソースもキーに含める
+// function_key : int -> int -> Hash
+static Hash function_key(int start, int end) {
+  Hash h = hash_tokens(cc->globals_hash, start, end);
+  if (!cc->debug_info)
+    return h;
+
+  int pos[2] = { tok_line(start), tok_column(start) };
+  h = hash_update(h, pos, sizeof(pos));
+  char *s = tok_str(start);
+  return hash_update(h, s, tok_str(end - 1) + cc->tokens.len[end - 1] - s);
+}
+
+// 目的：関数の本体の "{" を探し、対応する "}" の次のトークンの添字を返す。
+// 見つからなければ 0 を返す (エラーはパースするときに報告する)
+// skip_body : int -> int
+static int skip_body(int tok) {
+  int depth = 0;
+  for (; cc->tokens.kind[tok] != TK_EOF; tok++) {
+    if (cc->tokens.kind[tok] != TK_RESERVED || cc->tokens.len[tok] != 1)
+      continue;
+    char c = *tok_str(tok);
+    if (c == '{')
+      depth++;
+    else if (c == '}' && --depth == 0)
+      return tok + 1;
+  }
+  return 0;
+}
+
+// 目的：前回のコンパイルから変わっていない関数を、パースせずに読み飛ばす。
+// 関数のキーは、関数のトークン列と、それより前のすべてのグローバル変数の宣言から作る。
+// 前回の出力に同じキーの関数があれば、そのアセンブリを持つ Function を返す。なければ NULL を返す。
+// 読み飛ばした関数の文字列リテラルは、パースした場合と同じ順番でグローバル変数に登録する。
+// reuse_function : int -> char * -> Function || NULL
+static Function *reuse_function(int start, char *name) {
+  int end = skip_body(cc->token);
+  if (!end)
+    return NULL;
+
+  Function *fn = arena_alloc(&cc->arena, sizeof(Function));
+  fn->name = name;
+  fn->key = function_key(start, end);
+  if (!incr_lookup(fn))
+    return NULL;
+
+  for (int tok = start; tok < end; tok++)
+    if (cc->tokens.kind[tok] == TK_STR)
+      strlit_var(tok_strlit(tok));
+  cc->token = end;
+  return fn;
+}
+
+// 目的：トップレベルの宣言を1つパースする。
+// 関数ならその Function を返し、グローバル変数なら cc->globals に繋げて NULL を返す。
+// 型と名前を1回だけパースしてから、次が "(" なら関数、そうでなければグローバル変数として続きを読む。
+// toplevel = basetype ident (function | global-var)
+// toplevel : void -> Function || NULL
+Function *toplevel(void) {
+  int start = cc->token;
+  Type *ty = basetype();
+  int tok = cc->token;
+  char *name = expect_ident();
+
+  if (consume("(")) {
+    if (cc->incr) {
+      Function *fn = reuse_function(start, name);
+      if (fn)
+        return fn;
+    }
+
+    Function *fn = function(name, tok);
+    if (cc->incr)
+      fn->key = function_key(start, cc->token);
+    return fn;
+  }
+
+  global_var(ty, name);
+  if (cc->incr)
+    cc->globals_hash = hash_tokens(cc->globals_hash, start, cc->token);
+  return NULL;
 }
 
-// program = (global-var | function)*
+// program = toplevel*
 // program : void -> Function
 Program *program(void) {
   Function head = {};
   Function *cur = &head;
-  globals = NULL;
+  parse_init();
 
   // トークンが関数の場合、パースした関数を連結していく。
   // トークンがグローバル変数の場合、パースしたグローバル変数を連結していく。
   while (!at_eof()) {
-    if (is_function()) {
-      cur->next = function();
+    Function *fn = toplevel();
+    if (fn) {
+      cur->next = fn;
       cur = cur->next;
-    } else {
-      global_var();
     }
   }
   
-  Program *prog = calloc(1, sizeof(Program));
-  prog->globals = globals;    // プログラムに含まれるグローバル変数
+  Program *prog = arena_alloc(&cc->file_arena, sizeof(Program));
+  prog->globals = cc->globals;    // プログラムに含まれるグローバル変数
   prog->fns = head.next;      // プログラムに含まれる関数
   return prog;
 }
@@ -168,7 +353,7 @@ Program *program(void) {
 // basetype : void -> Type
 static Type *basetype(void) {
   if (!is_typename())
-    error_tok(token, "typename expected");
+    error_tok(cc->token, "typename expected");
 
   Type *ty;
   if (consume("char"))
@@ -210,7 +395,8 @@ static Type *struct_decl(void) {
     cur = cur->next;
   }
 
-  Type *ty = calloc(1, sizeof(Type));
+  note_alloc(MEM_TYPE, sizeof(Type));
+  Type *ty = arena_alloc(&cc->file_arena, sizeof(Type));
   ty->kind = TY_STRUCT;
   ty->members = head.next;
 
@@ -229,7 +415,7 @@ static Type *struct_decl(void) {
 // struct_member : void -> Member
 // struct-member = basetype ident ("[" num "]")* ";"
 static Member *struct_member(void) {
-  Member *mem = calloc(1, sizeof(Member));
+  Member *mem = arena_alloc(&cc->file_arena, sizeof(Member));
   mem->ty = basetype();
   mem->name = expect_ident();
   mem->ty = read_type_suffix(mem->ty);
@@ -244,7 +430,7 @@ static VarList *read_func_param(void) {
   char *name = expect_ident();
   ty = read_type_suffix(ty);
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(&cc->arena, sizeof(VarList));
   vl->var = new_lvar(name, ty);
   return vl;
 }
@@ -267,19 +453,19 @@ static VarList *read_func_params(void) {
   return head;
 }
 
-// 目的：関数をパースする
-// function = basetype ident "(" params? ")" "{" stmt* "}"
+// 目的：関数をパースする。戻り値の型、名前 (トークン tok)、"(" は toplevel() で読んである
+// function = params? ")" "{" stmt* "}"
 // params   = param ("," param)*
 // param    = basetype ident
-static Function *function(void) {
-  locals = NULL;
+static Function *function(char *name, int tok) {
+  double start = trace_begin();
+  cc->locals = NULL;
 
-  Function *fn = calloc(1, sizeof(Function));
-  basetype();
-  fn->name = expect_ident();
-  expect("(");
+  Function *fn = arena_alloc(&cc->arena, sizeof(Function));
+  fn->name = name;
+  fn->tok = tok;
 
-  VarList *sc = scope;
+  VarList *sc = cc->scope;
   fn->params = read_func_params();
   expect("{");
 
@@ -290,19 +476,18 @@ static Function *function(void) {
     cur->next = stmt();
     cur = cur->next;
   }
-  scope = sc;
+  cc->scope = sc;
 
   fn->node = head.next;
-  fn->locals = locals;
+  fn->locals = cc->locals;
+  trace_end("parse", name, start);
   return fn;
 }
 
-// 目的：グローバル変数をパースする。program()で使う。
-// global-var = basetype ident ("[" num "]")* ";"
-// global_var : void -> void
-static void global_var(void) {
-  Type *ty = basetype();
-  char *name = expect_ident();
+// 目的：グローバル変数をパースする。toplevel()で使う。型と名前は toplevel() で読んである
+// global-var = ("[" num "]")* ";"
+// global_var : Type -> char * -> void
+static void global_var(Type *ty, char *name) {
   ty = read_type_suffix(ty);
   expect(";");
   new_gvar(name, ty);
@@ -312,7 +497,7 @@ static void global_var(void) {
 // declaration = basetype ident ("[" num "]")* ("=" expr) ";"
 // declaration : void -> Node
 static Node *declaration(void) {
-  Token *tok =token;
+  int tok = cc->token;
   Type *ty = basetype();
   char *name = expect_ident();
   ty = read_type_suffix(ty);
@@ -331,7 +516,7 @@ static Node *declaration(void) {
 
 
 static Node *read_expr_stmt(void) {
-  Token *tok = token;
+  int tok = cc->token;
   return new_unary(ND_EXPR_STMT, expr(), tok);
 }
 
@@ -342,23 +527,15 @@ static bool is_typename(void) {
 }
 
 // stmt : void -> Node
-// stmt = stmt2
-static Node *stmt(void) {
-  Node *node = stmt2();
-  add_type(node);
-  return node;
-}
-
-// stmt2 : void -> Node
-// stmt2 = "return" expr ";"
+// stmt = "return" expr ";"
 //       | "if" "(" expr ")" stmt ("else" stmt)?
 //       | "while" "(" expr ")" stmt
 //       | "for" "(" expr? ";" expr? ";" expr? ")" stmt
 //       | "{" stmt* "}"
 //       | declaration
 //       | expr ";"
-static Node *stmt2(void) {
-  Token *tok;
+static Node *stmt(void) {
+  int tok;
   if (tok = consume("return")) {
     Node *node = new_unary(ND_RETURN, expr(), tok);
     expect(";");
@@ -412,12 +589,12 @@ static Node *stmt2(void) {
     Node head = {};
     Node *cur = &head;
 
-    VarList *sc = scope;
+    VarList *sc = cc->scope;
     while (!consume("}")) {
       cur->next = stmt();
       cur = cur->next;
     }
-    scope = sc;
+    cc->scope = sc;
 
     Node *node = new_node(ND_BLOCK, tok);
     node->body = head.next;
@@ -432,66 +609,48 @@ static Node *stmt2(void) {
   return node;
 }
 
-// expr : Node
-// expr = assign
-static Node *expr(void) {
-  return assign();
-}
-
-// assign : void -> Node
-// assign = equality ("=" assign)?
-static Node *assign(void) {
-  Node *node = equality();
-  Token *tok;
-  if (tok = consume("="))
-    node = new_binary(ND_ASSIGN, node, assign(), tok);
-  return node;
-}
-
-// 目的：== と != をパースする
-// equality : Node
-// equality = relational ("==" relational | "!=" relational)*
-static Node *equality(void) {
-  Node *node = relational();
-  Token *tok;
-
-  for (;;) {
-    if (tok = consume("=="))
-      node = new_binary(ND_EQ, node, relational(), tok);
-    else if (tok = consume("!="))
-      node = new_binary(ND_NE, node, relational(), tok);
-    else
-      return node;
-  }
-}
-
-// 目的：<, <=, >, >= をパースする
-// relational : Node
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(void) {
-  Node *node = add();
-  Token *tok;
+// 二項演算子の表。prec が大きいほど強く結合する。
+// 新しい二項演算子は、ここに1行追加し、codegen で kind を扱えばよい。
+typedef struct {
+  char *op;         // 演算子の記号
+  int prec;         // 優先順位
+  NodeKind kind;    // 作るノードの種類
+  bool swap;        // 左辺と右辺を入れ替えるか (">" と ">=")
+  bool right_assoc; // 右結合か ("=")
+} BinOp;
+
+static BinOp binops[] = {
+  {"=",  1, ND_ASSIGN, false, true},
+  {"==", 2, ND_EQ},
+  {"!=", 2, ND_NE},
+  {"<",  3, ND_LT},
+  {"<=", 3, ND_LE},
+  {">",  3, ND_LT, true},
+  {">=", 3, ND_LE, true},
+  {"+",  4, ND_ADD},
+  {"-",  4, ND_SUB},
+  {"*",  5, ND_MUL},
+  {"/",  5, ND_DIV},
+  {NULL},
+};
+
+// 目的：現在のトークンが二項演算子なら、その表の項目を返す。違えば NULL を返す。
+// find_binop : void -> BinOp || NULL
+static BinOp *find_binop(void) {
+  if (cc->tokens.kind[cc->token] != TK_RESERVED)
+    return NULL;
 
-  for (;;) {
-    if (tok = consume("<"))
-      node = new_binary(ND_LT, node, add(), tok);
-    else if (tok = consume("<="))
-      node = new_binary(ND_LE, node, add(), tok);
-    else if (tok = consume(">"))
-      node = new_binary(ND_LT, add(), node, tok);
-    else if (tok = consume(">="))
-      node = new_binary(ND_LE, add(), node, tok);
-    else
-      return node;
-  }
+  char *s = tok_str(cc->token);
+  int len = cc->tokens.len[cc->token];
+  for (BinOp *op = binops; op->op; op++)
+    if (op->op[0] == s[0] && strlen(op->op) == len && !strncmp(op->op, s, len))
+      return op;
+  return NULL;
 }
 
 // 目的：左辺値と右辺値を受け取り、型情報を加えて、式に応じた Node を返す
-// new_add : Node -> Node -> Token -> Node
-static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
-  add_type(lhs);
-  add_type(rhs);
-
+// new_add : Node -> Node -> int -> Node
+static Node *new_add(Node *lhs, Node *rhs, int tok) {
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_ADD, lhs, rhs, tok);
   if (lhs->ty->base && is_integer(rhs->ty))
@@ -502,11 +661,8 @@ static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
 }
 
 // 目的：左辺値と右辺値を受け取り、型情報を加えて、式に応じた Node を返す
-// new_sub : Node -> Node -> Token -> Node
-static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
-  add_type(lhs);
-  add_type(rhs);
-
+// new_sub : Node -> Node -> int -> Node
+static Node *new_sub(Node *lhs, Node *rhs, int tok) {
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_SUB, lhs, rhs, tok);
   if (lhs->ty->base && is_integer(rhs->ty))
@@ -516,46 +672,48 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
   error_tok(tok, "演算子が間違っています");
 }
 
-// 目的：＋とーの演算子をパースする
-// add : Node
-// add = mul ("+" mul | "-" mul)*
-static Node *add(void) {
-  Node *node = mul();
-  Token *tok;
-
-  for (;;) {
-    if (tok = consume("+"))
-      node = new_add(node, mul(), tok);
-    else if (tok = consume("-"))
-      node = new_sub(node, mul(), tok);
-    else
-      return node;
-  }
+// 目的：二項演算子の表の項目と左辺・右辺を受け取り、演算子に応じた Node を返す
+// new_binop : BinOp -> Node -> Node -> int -> Node
+static Node *new_binop(BinOp *op, Node *lhs, Node *rhs, int tok) {
+  if (op->kind == ND_ADD)
+    return new_add(lhs, rhs, tok);
+  if (op->kind == ND_SUB)
+    return new_sub(lhs, rhs, tok);
+  if (op->swap)
+    return new_binary(op->kind, rhs, lhs, tok);
+  return new_binary(op->kind, lhs, rhs, tok);
 }
 
-// 目的：*と/の演算子をパースする
-// mul : Node
-// mul = unary ("*" unary | "/" unary)*
-static Node *mul(void) {
+// 目的：優先順位が min_prec 以上の二項演算子からなる式をパースする (優先順位上昇法)
+// 左結合の演算子の連続はループで処理するので、再帰の深さは優先順位の段数で抑えられる。
+// binary : int -> Node
+// binary = unary (binop unary)*
+static Node *binary(int min_prec) {
   Node *node = unary();
-  Token *tok;
 
   for (;;) {
-    if (tok = consume("*"))
-      node = new_binary(ND_MUL, node, unary(), tok);
-    else if (tok = consume("/"))
-      node = new_binary(ND_DIV, node, unary(), tok);
-    else
+    BinOp *op = find_binop();
+    if (!op || op->prec < min_prec)
       return node;
+
+    int tok = cc->token++;
+    Node *rhs = binary(op->right_assoc ? op->prec : op->prec + 1);
+    node = new_binop(op, node, rhs, tok);
   }
 }
 
+// expr : Node
+// expr = binary(1)
+static Node *expr(void) {
+  return binary(1);
+}
+
 // 目的：正負の記号をパースする
 // unary : Node
 // unary = ("+" | "-" | "*" | "&")? unary
 //       | postfix
 static Node *unary(void) {
-  Token *tok;
+  int tok;
   if (consume("+"))
     return unary();
   if (tok = consume("-"))
@@ -579,24 +737,25 @@ static Member *find_member(Type *ty, char *name) {
 // 目的：構造体のメンバーをみつけてメンバーの型をもった Node を返す
 // struct_ref : Node -> Node
 struct Node *struct_ref(Node *lhs) {
-  add_type(lhs);
   if (lhs->ty->kind != TY_STRUCT)
     error_tok(lhs->tok, "not a struct");
   
-  Token *tok = token;
+  int tok = cc->token;
   Member *mem = find_member(lhs->ty, expect_ident());
   if (!mem)
     error_tok(tok, "no such member");
 
-  Node *node = new_unary(ND_MEMBER, lhs, tok);
+  Node *node = new_node(ND_MEMBER, tok);
+  node->lhs = lhs;
   node->member = mem;
+  add_type(node);
   return node;
 }
 
 // postfix = primary ("[" expr "]" | "." ident)*
 static Node *postfix(void) {
   Node *node = primary();
-  Token *tok;
+  int tok;
 
   for (;;) {
     if (tok = consume("[")) {
@@ -611,46 +770,54 @@ static Node *postfix(void) {
       node = struct_ref(node);
       continue;
     }
-  }
 
-  return node;
+    return node;
+  }
 }
 
 // stmt-expr = "(" "{" stmt stmt* "}" ")"
 // Statement expression is a GNU C extension
-static Node *stmt_expr(Token *tok) {
-  VarList *sc = scope;
+static Node *stmt_expr(int tok) {
+  VarList *sc = cc->scope;
 
   Node *node = new_node(ND_STMT_EXPR, tok);
   node->body = stmt();
+  Node *prev = NULL;
   Node *cur = node->body;
 
   while (!consume("}")) {
     cur->next = stmt();
+    prev = cur;
     cur = cur->next;
   }
   expect(")");
 
-  scope = sc;
+  cc->scope = sc;
 
   if (cur->kind != ND_EXPR_STMT)
     error_tok(cur->tok, "stmt expr returning void is not supported");
-  memcpy(cur, cur->lhs, sizeof(Node));
+
+  // 最後の式文を、その式そのものに置き換える
+  if (prev)
+    prev->next = cur->lhs;
+  else
+    node->body = cur->lhs;
+  add_type(node);
   return node;
 }
 
 
 // 目的：関数の引数をパースする
 // func_args : void -> Node | NULL
-// func_args = "(" (assign ("," assign)*)? ")"
+// func_args = "(" (expr ("," expr)*)? ")"
 static Node *func_args(void) {
   if (consume(")"))
     return NULL;
   
-  Node *head = assign();
+  Node *head = expr();
   Node *cur = head;
   while (consume(",")) {
-    cur->next = assign();
+    cur->next = expr();
     cur = cur->next;
   }
   expect(")");
@@ -666,7 +833,7 @@ static Node *func_args(void) {
 //         | str
 //         | num
 static Node *primary(void) {
-  Token *tok;
+  int tok;
 
   if (tok = consume("(")) {
     if (consume("{"))
@@ -679,7 +846,6 @@ static Node *primary(void) {
 
   if (tok = consume("sizeof")) {
     Node *node = unary();
-    add_type(node);
     return new_num(node->ty->size, tok);
   }
 
@@ -687,8 +853,9 @@ static Node *primary(void) {
     // Function Call
     if (consume("(")) {
       Node *node = new_node(ND_FUNCALL, tok);
-      node->funcname = strndup(tok->str, tok->len);
+      node->funcname = arena_strndup(&cc->arena, tok_str(tok), cc->tokens.len[tok]);
       node->args = func_args();
+      add_type(node);
       return node;
     }
 
@@ -698,18 +865,15 @@ static Node *primary(void) {
     return new_var_node(var, tok);
   }
   
-  tok = token;
-  if (tok->kind == TK_STR) {
-    token = token->next;
-
-    Type *ty = array_of(char_type, tok->cont_len);
-    Var *var = new_gvar(new_label(), ty);
-    var->contents = tok->contents;
-    var->cont_len = tok->cont_len;
+  tok = cc->token;
+  if (cc->tokens.kind[tok] == TK_STR) {
+    cc->token++;
+
+    Var *var = strlit_var(tok_strlit(tok));
     return new_var_node(var, tok);
   }
 
-  if (tok->kind != TK_NUM)
+  if (cc->tokens.kind[tok] != TK_NUM)
     error_tok(tok, "期待していた式です");
   return new_num(expect_number(), tok);
 }
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "9cc.h"
+
+// 計測結果を使った最適化 (-fprofile-use)。
+// -fprofile-generate で埋め込んだコードが書き出したファイルを読み、ファイル名と関数名からカウンタを引けるようにする。
+// ファイルは追記していくので、同じ関数の行が何度も現れる。カウンタの数が同じなら足し合わせ、
+// 違うならソースが変わる前の古い計測結果なので、後の行で置き換える。
+
+// 1つの関数のカウンタ
+typedef struct {
+  char *file;
+  char *func;
+  long *counts;
+  int n;
+} ProfEntry;
+
+// ファイル名と関数名をキーにしたハッシュ表。file が NULL のエントリは空き
+struct Profile {
+  ProfEntry *entries;
+  int cap;
+  int used;
+};
+
+// 目的：ファイル名と関数名の組のハッシュ値を返す
+// hash_key : char * -> char * -> unsigned long
+static unsigned long hash_key(char *file, char *func) {
+  Hash h = hash_init();
+  h = hash_update(h, file, strlen(file) + 1);
+  h = hash_update(h, func, strlen(func));
+  return (unsigned long)h;
+}
+
+// 目的：file と func のエントリの添字を返す。なければ空きの添字を返す
+// find_slot : Profile -> char * -> char * -> int
+static int find_slot(Profile *prof, char *file, char *func) {
+  int i = hash_key(file, func) & (prof->cap - 1);
+  for (ProfEntry *e; (e = &prof->entries[i])->file; i = (i + 1) & (prof->cap - 1))
+    if (!strcmp(e->file, file) && !strcmp(e->func, func))
+      return i;
+  return i;
+}
+
+// 目的：ハッシュ表の大きさを倍にする
+// grow_profile : Profile -> void
+static void grow_profile(Profile *prof) {
+  ProfEntry *old = prof->entries;
+  int old_cap = prof->cap;
+  prof->cap = old_cap ? old_cap * 2 : 64;
+  prof->entries = calloc(prof->cap, sizeof(ProfEntry));
+  for (int i = 0; i < old_cap; i++)
+    if (old[i].file)
+      prof->entries[find_slot(prof, old[i].file, old[i].func)] = old[i];
+  free(old);
+}
+
+// 目的：ファイルの1行「ファイル名 関数名 カウンタの数 カウンタ...」を表に加える。形が正しくない行は無視する
+// add_line : Profile -> char * -> void
+static void add_line(Profile *prof, char *line) {
+  char *save;
+  char *file = strtok_r(line, " \n", &save);
+  char *func = strtok_r(NULL, " \n", &save);
+  char *num = strtok_r(NULL, " \n", &save);
+  if (!file || !func || !num)
+    return;
+  int n = atoi(num);
+  if (n <= 0)
+    return;
+
+  long *counts = calloc(n, sizeof(long));
+  for (int i = 0; i < n; i++) {
+    char *tok = strtok_r(NULL, " \n", &save);
+    if (!tok) {
+      free(counts);
+      return;
+    }
+    counts[i] = atol(tok);
+  }
+
+  if (prof->used * 4 >= prof->cap * 3)
+    grow_profile(prof);
+  ProfEntry *e = &prof->entries[find_slot(prof, file, func)];
+  if (e->file && e->n == n) {
+    for (int i = 0; i < n; i++)
+      e->counts[i] += counts[i];
+    free(counts);
+    return;
+  }
+
+  if (e->file) {
+    free(e->counts);
+  } else {
+    e->file = strdup(file);
+    e->func = strdup(func);
+    prof->used++;
+  }
+  e->counts = counts;
+  e->n = n;
+}
+
+// 目的：path の計測結果を読み込む。読めなければ NULL を返す
+// profile_load : char * -> Profile
+Profile *profile_load(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  Profile *prof = calloc(1, sizeof(Profile));
+  grow_profile(prof);
+  char *line = NULL;
+  size_t cap = 0;
+  while (getline(&line, &cap, fp) > 0)
+    add_line(prof, line);
+  free(line);
+  fclose(fp);
+  return prof;
+}
+
+// 目的：ファイル file の関数 func のカウンタを返し、その数を *n に入れる。計測結果になければ NULL を返す
+// profile_find : Profile -> char * -> char * -> int * -> long *
+long *profile_find(Profile *prof, char *file, char *func, int *n) {
+  ProfEntry *e = &prof->entries[find_slot(prof, file, func)];
+  if (!e->file)
+    return NULL;
+  *n = e->n;
+  return e->counts;
+}
+
+// 目的：計測結果を解放する
+// profile_free : Profile -> void
+void profile_free(Profile *prof) {
+  if (!prof)
+    return;
+  for (int i = 0; i < prof->cap; i++) {
+    free(prof->entries[i].file);
+    free(prof->entries[i].func);
+    free(prof->entries[i].counts);
+  }
+  free(prof->entries);
+  free(prof);
+}
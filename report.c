@@ -0,0 +1,162 @@
+#include "9cc.h"
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+// 計測とトレース。
+// --time-report と --mem-report のために、フェーズごとの時間とオブジェクトの種類ごとのメモリの量を
+// cc->stats に数える。--trace を指定したときは、フェーズと関数ごとの区間を記録し、
+// Chrome のトレースイベントの形式 (chrome://tracing や Perfetto で読める JSON) で書き出す。
+
+static char *phase_names[] = { "read", "tokenize", "parse", "layout", "codegen" };
+static char *mem_kind_names[] = { "token", "node", "type", "var" };
+
+// 目的：時計 clock の現在の値をマイクロ秒で返す
+// clock_usec : clockid_t -> double
+static double clock_usec(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// 目的：フェーズの開始時刻を返す。計測していなければ何もしない
+// timer_start : void -> Timer
+Timer timer_start(void) {
+  if (!cc->timing)
+    return (Timer){};
+  return (Timer){ clock_usec(CLOCK_MONOTONIC), clock_usec(CLOCK_THREAD_CPUTIME_ID) };
+}
+
+// 目的：t に始まったフェーズ phase の時間を cc->stats に足す。トレース中なら区間も記録する
+// timer_stop : Timer -> Phase -> void
+void timer_stop(Timer *t, Phase phase) {
+  if (!cc->timing)
+    return;
+  cc->stats.wall[phase] += clock_usec(CLOCK_MONOTONIC) - t->wall;
+  cc->stats.cpu[phase] += clock_usec(CLOCK_THREAD_CPUTIME_ID) - t->cpu;
+  trace_end(phase_names[phase], cc->filename, t->wall);
+}
+
+// 目的：種類 kind のオブジェクトを size バイト確保したことを数える
+// note_alloc : MemKind -> size_t -> void
+void note_alloc(MemKind kind, size_t size) {
+  cc->stats.count[kind]++;
+  cc->stats.bytes[kind] += size;
+}
+
+// トレースの区間
+typedef struct {
+  char *cat;      // 区間の分類。フェーズの名前
+  char *name;     // 関数やファイルの名前
+  double ts;      // 開始時刻 (マイクロ秒)
+  double dur;     // 長さ (マイクロ秒)
+  int tid;        // 区間を実行したスレッドの番号
+} TraceEvent;
+
+// 区間は複数のスレッドから記録するので、まとめてロックで守る
+static bool tracing;
+static TraceEvent *trace_events;
+static int trace_len;
+static int trace_cap;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int next_tid = 1;
+static _Thread_local int trace_tid;   // このスレッドの番号。0 ならまだ割り当てていない
+
+// 目的：区間の記録を始める
+// trace_start : void -> void
+void trace_start(void) {
+  tracing = true;
+}
+
+// 目的：トレース中なら区間の開始時刻を、そうでなければ 0 を返す
+// trace_begin : void -> double
+double trace_begin(void) {
+  return tracing ? clock_usec(CLOCK_MONOTONIC) : 0;
+}
+
+// 目的：start に始まり今終わった区間を記録する。トレース中でなければ何もしない
+// trace_end : char * -> char * -> double -> void
+void trace_end(char *cat, char *name, double start) {
+  if (!tracing)
+    return;
+  double now = clock_usec(CLOCK_MONOTONIC);
+  if (!trace_tid)
+    trace_tid = atomic_fetch_add(&next_tid, 1);
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_len == trace_cap) {
+    trace_cap = trace_cap ? trace_cap * 2 : 1024;
+    trace_events = realloc(trace_events, trace_cap * sizeof(TraceEvent));
+  }
+  trace_events[trace_len++] = (TraceEvent){ cat, strdup(name), start, now - start, trace_tid };
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// 目的：JSON の文字列として s を書き出す
+// write_json_string : FILE -> char * -> void
+void write_json_string(FILE *fp, char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(fp, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(fp, "\\u%04x", *s);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+// 目的：記録した区間を path に書き出し、記録をやめる。書き出せなければ false を返す
+// trace_finish : char * -> bool
+bool trace_finish(char *path) {
+  tracing = false;
+  FILE *fp = fopen(path, "w");
+  if (fp) {
+    int pid = getpid();
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (int i = 0; i < trace_len; i++) {
+      TraceEvent *e = &trace_events[i];
+      fprintf(fp, "{\"ph\":\"X\",\"cat\":\"%s\",\"name\":", e->cat);
+      write_json_string(fp, e->name);
+      fprintf(fp, ",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}%s\n",
+              e->ts, e->dur, pid, e->tid, i + 1 < trace_len ? "," : "");
+    }
+    fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+  }
+
+  for (int i = 0; i < trace_len; i++)
+    free(trace_events[i].name);
+  free(trace_events);
+  trace_events = NULL;
+  trace_len = trace_cap = 0;
+  return fp && !fclose(fp);
+}
+
+// 目的：フェーズごとの実時間と CPU 時間を表示する
+// print_time_report : FILE -> Stats -> void
+void print_time_report(FILE *out, Stats *stats) {
+  double wall = 0, cpu = 0;
+  fprintf(out, "time report:\n");
+  fprintf(out, "  %-10s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+  for (int i = 0; i < NUM_PHASES; i++) {
+    fprintf(out, "  %-10s %12.3f %12.3f\n", phase_names[i], stats->wall[i] / 1e3, stats->cpu[i] / 1e3);
+    wall += stats->wall[i];
+    cpu += stats->cpu[i];
+  }
+  fprintf(out, "  %-10s %12.3f %12.3f\n", "total", wall / 1e3, cpu / 1e3);
+}
+
+// 目的：オブジェクトの種類ごとの数とバイト数、プロセスの最大 RSS を表示する
+// print_mem_report : FILE -> Stats -> void
+void print_mem_report(FILE *out, Stats *stats) {
+  fprintf(out, "memory report:\n");
+  fprintf(out, "  %-10s %12s %14s\n", "kind", "count", "bytes");
+  for (int i = 0; i < NUM_MEM_KINDS; i++)
+    fprintf(out, "  %-10s %12ld %14ld\n", mem_kind_names[i], stats->count[i], stats->bytes[i]);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(out, "  peak RSS: %ld KB\n", ru.ru_maxrss);
+}
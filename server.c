@@ -0,0 +1,331 @@
+#include "9cc.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// コンパイルサーバー。
+// 小さなファイルを大量にコンパイルすると、プロセスの起動や実行ファイルの読み込みに時間の大半を取られる。
+// サーバーは起動したまま要求を待ち、アリーナのブロックやコンパイラのハッシュ値を要求の間で使い回す。
+// 型や文字列リテラルの intern テーブルは使い回さない。登録した型はそのコンパイルのアリーナにあり、
+// 文字列リテラルはその入力を指すので、コンパイルが終わると使えなくなる。
+//
+// クライアントは、標準入力、標準出力、標準エラー出力、カレントディレクトリのファイル記述子を
+// SCM_RIGHTS でサーバーに渡し、続けて引数を送る。
+// サーバーはそれらの記述子を自分の 0, 1, 2 とカレントディレクトリに付け替えてから driver_main() を呼ぶので、
+// 出力ファイルや相対パス、標準出力への出力は、クライアントがその場でコンパイルしたときと同じになる。
+// 最後に終了ステータスを返す。
+// 記述子の付け替えはプロセス全体に効くので、要求は1つずつ処理する。1つの要求の中では -j が使える。
+// サーバーは要求したユーザーの権限でファイルを読み書きするので、ソケットは所有者だけが使えるように作り、
+// サーバーと同じユーザー以外からの接続は断る。
+
+// サーバーに渡す記述子の数。標準入力、標準出力、標準エラー出力、カレントディレクトリ
+#define NFDS 4
+
+// 要求の引数の合計のバイト数の上限
+#define MAX_REQUEST (1024 * 1024)
+
+// 要求を受け取るときと終了ステータスを返すときに待つ秒数。
+// 要求は1つずつ処理するので、接続したまま何も送らないクライアントが他の要求を止めないようにする
+#define REQUEST_TIMEOUT 2
+
+// 要求の先頭。記述子と一緒に送る
+typedef struct {
+  uint32_t argc;
+  uint32_t len;   // 続けて送る引数のバイト数。各引数は '\0' で終わる
+} RequestHeader;
+
+// 目的：len バイトをすべて読み込む。途中で接続が切れたら false を返す
+// read_full : int -> void * -> size_t -> bool
+static bool read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 目的：len バイトをすべて書き込む
+// write_full : int -> void * -> size_t -> bool
+static bool write_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 目的：path を指す Unix ドメインソケットのアドレスを作る
+// socket_addr : char * -> struct sockaddr_un -> bool
+static bool socket_addr(char *path, struct sockaddr_un *addr) {
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return false;
+  *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+// 目的：受け取ったメッセージに付いていた記述子をすべて閉じる
+// close_received : struct msghdr -> void
+static void close_received(struct msghdr *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < n; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      close(fd);
+    }
+  }
+}
+
+// 目的：要求のヘッダとクライアントの記述子を受け取る。
+// 形が正しくなければ、届いた記述子をすべて閉じて false を返す
+// recv_header : int -> RequestHeader -> int * -> bool
+static bool recv_header(int conn, RequestHeader *hdr, int *fds) {
+  // 余分な記述子が付いてきても切り詰められないように、期待する数より大きな領域で受け取る
+  char control[CMSG_SPACE(NFDS * 2 * sizeof(int))];
+  struct iovec iov = { hdr, sizeof(*hdr) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  ssize_t n = recvmsg(conn, &msg, 0);
+  if (n < 0)
+    return false;
+
+  // 制御データが切り詰められたメッセージも断る。受け取れた分の記述子は閉じる
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(*hdr) || (msg.msg_flags & MSG_CTRUNC) || !cmsg ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(NFDS * sizeof(int)) || CMSG_NXTHDR(&msg, cmsg)) {
+    close_received(&msg);
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), NFDS * sizeof(int));
+  return true;
+}
+
+// 目的：クライアントの記述子を標準入出力とカレントディレクトリにして、引数どおりにコンパイルする。
+// 失敗はサーバーの標準エラー出力に書き、その要求だけを失敗させる
+// run_request : int -> int * -> char ** -> int
+static int run_request(int argc, int *fds, char **argv) {
+  // 標準入出力とカレントディレクトリを付け替える前に、サーバーのものを取っておく
+  int saved[NFDS];
+  for (int i = 0; i < 3; i++)
+    saved[i] = dup(i);
+  saved[3] = open(".", O_RDONLY | O_DIRECTORY);
+  if (saved[0] < 0 || saved[1] < 0 || saved[2] < 0 || saved[3] < 0) {
+    fprintf(stderr, "9cc: cannot save the server's descriptors: %s\n", strerror(errno));
+    for (int i = 0; i < NFDS; i++)
+      if (saved[i] >= 0)
+        close(saved[i]);
+    return 1;
+  }
+
+  for (int i = 0; i < 3; i++)
+    dup2(fds[i], i);
+  int status = 1;
+  if (!fchdir(fds[3])) {
+    clearerr(stdin);
+    status = driver_main(argc, argv);
+  }
+  fflush(stdout);
+  fflush(stderr);
+
+  for (int i = 0; i < 3; i++) {
+    dup2(saved[i], i);
+    close(saved[i]);
+  }
+  // 戻せなくても、次の要求はその要求のカレントディレクトリに移るので、サーバーは続けられる
+  if (fchdir(saved[3])) {
+    fprintf(stderr, "9cc: cannot restore the working directory: %s\n", strerror(errno));
+    status = 1;
+  }
+  close(saved[3]);
+  clearerr(stdin);
+  return status;
+}
+
+// 目的：'\0' で区切られた argc 個の引数を buf から切り出す。形が正しくなければ NULL を返す
+// split_args : char * -> size_t -> int -> char **
+static char **split_args(char *buf, size_t len, int argc) {
+  if (len == 0 || buf[len - 1] != '\0')
+    return NULL;
+
+  char **argv = calloc(argc + 1, sizeof(char *));
+  if (!argv)
+    return NULL;
+  char *p = buf;
+  for (int i = 0; i < argc; i++) {
+    if (p >= buf + len) {
+      free(argv);
+      return NULL;
+    }
+    argv[i] = p;
+    p += strlen(p) + 1;
+  }
+  return argv;
+}
+
+// 目的：接続してきたプロセスがサーバーと同じユーザーのものかどうかを返す
+// same_user : int -> bool
+static bool same_user(int conn) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred))
+    return false;
+  return cred.uid == geteuid();
+}
+
+// 目的：1つの接続から要求を受け取って処理し、終了ステータスを返す
+// handle : int -> void
+static void handle(int conn) {
+  if (!same_user(conn))
+    return;
+
+  struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT };
+  if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+      setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+    return;
+
+  RequestHeader hdr;
+  int fds[NFDS];
+  if (!recv_header(conn, &hdr, fds))
+    return;
+
+  char *buf = NULL;
+  char **argv = NULL;
+  // 各引数は少なくとも '\0' の1バイトを使うので、argc が len 以下なら int に収まる
+  if (hdr.argc > 0 && hdr.argc <= hdr.len && hdr.len <= MAX_REQUEST) {
+    buf = malloc(hdr.len + 1);
+    if (buf && read_full(conn, buf, hdr.len))
+      argv = split_args(buf, hdr.len, hdr.argc);
+  }
+
+  if (argv) {
+    int32_t status = run_request(hdr.argc, fds, argv);
+    write_full(conn, &status, sizeof(status));
+  }
+
+  for (int i = 0; i < NFDS; i++)
+    close(fds[i]);
+  free(argv);
+  free(buf);
+}
+
+// 目的：Unix ドメインソケット path で待ち受け、クライアントの要求を1つずつ処理し続ける
+// serve : char * -> int
+int serve(char *path) {
+  struct sockaddr_un addr;
+  if (!socket_addr(path, &addr))
+    error("%s: ソケットのパスが長すぎます", path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    error("cannot create socket: %s", strerror(errno));
+
+  // 前に動いていたサーバーが残したソケットは消し、所有者だけが使えるように 0600 で作り直す
+  unlink(path);
+  mode_t mask = umask(0177);
+  int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (bound || listen(sock, 64))
+    error("cannot listen on %s: %s", path, strerror(errno));
+
+  // クライアントが先に終了しても、その出力に書いたサーバーが終了しないようにする
+  signal(SIGPIPE, SIG_IGN);
+
+  // 要求の間でアリーナのブロックを使い回す
+  arena_retain(64 * 1024 * 1024);
+
+  // 記述子が足りないときや、クライアントが先に接続をやめたときの accept の失敗は一時的なものなので、
+  // 書き出して待ち受けを続ける。記述子が空くまで少し待ち、同じ失敗が続く間は一度だけ書き出す
+  int last_err = 0;
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK)
+        error("accept: %s", strerror(errno));
+      if (errno != EINTR) {
+        if (errno != last_err)
+          fprintf(stderr, "9cc: accept: %s\n", strerror(errno));
+        last_err = errno;
+        nanosleep(&(struct timespec){ .tv_nsec = 10 * 1000 * 1000 }, NULL);
+      }
+      continue;
+    }
+    last_err = 0;
+    handle(conn);
+    close(conn);
+  }
+}
+
+// 目的：サーバーに引数を送ってコンパイルしてもらい、その終了ステータスを返す。
+// サーバーにつながらなければ、この場でコンパイルする
+// client : char * -> int -> char ** -> int
+int client(char *path, int argc, char **argv) {
+  struct sockaddr_un addr;
+  int sock = -1;
+  if (socket_addr(path, &addr))
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    if (sock >= 0)
+      close(sock);
+    return driver_main(argc, argv);
+  }
+
+  int cwd = open(".", O_RDONLY | O_DIRECTORY);
+  if (cwd < 0)
+    error("cannot open the working directory: %s", strerror(errno));
+  int fds[NFDS] = { 0, 1, 2, cwd };
+
+  RequestHeader hdr = { .argc = argc };
+  for (int i = 0; i < argc; i++)
+    hdr.len += strlen(argv[i]) + 1;
+
+  char control[CMSG_SPACE(NFDS * sizeof(int))] = {};
+  struct iovec iov = { &hdr, sizeof(hdr) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(NFDS * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(sock, &msg, 0) != sizeof(hdr))
+    error("%s: cannot send a request: %s", path, strerror(errno));
+  for (int i = 0; i < argc; i++)
+    if (!write_full(sock, argv[i], strlen(argv[i]) + 1))
+      error("%s: cannot send a request: %s", path, strerror(errno));
+
+  int32_t status;
+  if (!read_full(sock, &status, sizeof(status)))
+    error("%s: サーバーが応答しませんでした", path);
+  close(sock);
+  close(cwd);
+  return status;
+}
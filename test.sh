@@ -28,6 +28,21 @@ assert() {
     fi
 }
 
+# 目的：条件 cond を eval して、成り立てば "name => ok" を表示し、成り立たなければ "name => ng" を表示して終了する
+check() {
+    name="$1"
+    cond="$2"
+    ok="$3"
+    ng="$4"
+
+    if eval "$cond"; then
+        echo "$name => $ok"
+    else
+        echo "$name => $ng"
+        exit 1
+    fi
+}
+
 
 assert 0 'int main() { return 0; }'
 assert 42 'int main() { return 42; }'
@@ -198,4 +213,275 @@ assert 2 'int main() { int x=2; { int x=3; } return x; }'
 assert 2 'int main() { int x=2; { int x=3; } { int y=4; return x; }}'
 assert 3 'int main() { int x=2; { x=3; } return x; }'
 
+# 1024バイトを超える文字列リテラル
+long=$(printf 'a%.0s' $(seq 2000))
+assert 209 "int main() { return sizeof(\"$long\"); }"
+assert 98 "int main() { return \"${long}b\"[2000]; }"
+assert 10 "int main() { return \"${long}\\n\"[2000]; }"
+
+# 10万段の深さにネストした式 (1+1+...+1) をコンパイルできるか調べる
+deep="int main() { return $(printf '1+%.0s' $(seq 99999))1; }"
+./9cc <(echo "$deep") > tmp.s || exit 1
+gcc -static -o tmp tmp.s tmp2.o
+./tmp
+actual="$?"
+check "1+1+...+1 (100000 terms)" '[ "$actual" = 160 ]' "$actual" "160 expected, but got $actual"
+
+# 1万段の括弧にネストしたポインタの式と、右にネストした式 1+(1+(...(1))) の型を付けられるか調べる
+nested="int main() { int a[2]; a[0]=7; int *p=a; return *$(printf '(%.0s' $(seq 10000))p$(printf '+1)-1)%.0s' $(seq 5000)) + $(printf '1+(%.0s' $(seq 9999))1$(printf ')%.0s' $(seq 9999)); }"
+./9cc <(echo "$nested") > tmp.s || exit 1
+gcc -static -o tmp tmp.s tmp2.o
+./tmp
+actual="$?"
+check "*((p+1)-1)... + 1+(1+(...)) (10000 levels)" '[ "$actual" = 23 ]' "$actual" "23 expected, but got $actual"
+
+# 複数のファイルを -j で並行にコンパイルし、出力ディレクトリの .s をリンクする
+mkdir -p tmp.d
+echo 'int main() { return sub3(add1(6)); }' > tmp.d/a.c
+echo 'int sub3(int x) { return x-3; }' > tmp.d/b.c
+echo 'int add1(int x) { return x+1; }' > tmp.d/c.c
+./9cc -j 2 -o tmp.d tmp.d/a.c tmp.d/b.c tmp.d/c.c || exit 1
+gcc -static -o tmp tmp.d/a.s tmp.d/b.s tmp.d/c.s
+./tmp
+actual="$?"
+rm -rf tmp.d
+check "-j 2 -o tmp.d a.c b.c c.c" '[ "$actual" = 4 ]' "$actual" "4 expected, but got $actual"
+
+# 関数ごとに並列にコード生成しても、逐次の場合と同じアセンブリになるか調べる
+./9cc tests > tmp.s || exit 1
+check "--codegen-threads=4 tests" './9cc --codegen-threads=4 tests | cmp -s - tmp.s' \
+    "same output" "output differs from serial codegen"
+
+# 1 MB を超える入力をチャンクに分けて並列にトークナイズしても、逐次の場合と同じアセンブリとエラーになるか調べる。
+# コメントや文字列リテラルの中に、改行や引用符やコメントの記号を入れておく
+awk 'BEGIN {
+    for (i = 0; i < 40000; i++) {
+        printf "/* \"%d\n // */ int f%d() { char *s = \"/* \\\" // %d\"; // \" /*\n", i, i, i
+        printf "  return s[1] + %d; }\n", i
+    }
+    print "int main() { return f7() - 7; }"
+}' > tmp.c
+./9cc tmp.c > tmp.s || exit 1
+./9cc --tokenize-threads=3 tmp.c > tmp2.s || exit 1
+echo 'int main() { return "a; }' >> tmp.c
+./9cc tmp.c > /dev/null 2> tmp.err
+./9cc --tokenize-threads=3 tmp.c > /dev/null 2> tmp2.err
+check "--tokenize-threads=3 (3 MB)" \
+    '[ $(stat -c %s tmp.c) -gt 3000000 ] && cmp -s tmp.s tmp2.s && [ -s tmp.err ] && cmp -s tmp.err tmp2.err' \
+    "same output" "output or error differs from serial tokenizing"
+rm -f tmp.c tmp.err tmp2.err
+
+# SIMD を使うトークナイザーと使わないトークナイザーで、同じトークン列とアセンブリになるか調べる。
+# 行の先頭の空白の数を変えて、コメントの終わりや引用符、識別子や空白の並びが16バイトの境界をまたぐようにする
+make -s 9cc-nosimd > /dev/null || exit 1
+awk 'BEGIN {
+    for (pad = 0; pad < 48; pad++) {
+        sp = sprintf("%" pad "s", "")
+        id = sprintf("%" (pad + 1) "s", ""); gsub(/ /, "a", id)
+        printf "%s/*%s*/ int %s%d() {%s// \"%s\n", sp, substr(sp, 1, pad % 17), id, pad, sp, sp
+        printf "%s/* \" ** %s*/char *s = \"%s\\\"*/\\\\\";%s/***/\n", sp, sp, sp, sp
+        printf "\t%sreturn s[%d] + %d;/**/}\n", sp, pad % 3, pad
+    }
+    print "int main() { return a0(); }"
+}' > tmp.c
+./9cc --dump-tokens tmp.c > tmp.s || exit 1
+./9cc-nosimd --dump-tokens tmp.c > tmp2.s || exit 1
+./9cc tmp.c > tmp3.s || exit 1
+./9cc-nosimd tmp.c > tmp4.s || exit 1
+check "9cc-nosimd (16-byte boundaries)" '[ -s tmp.s ] && cmp -s tmp.s tmp2.s && cmp -s tmp3.s tmp4.s' \
+    "same tokens and output" "tokens or output differ from the SIMD tokenizer"
+rm -f tmp.c tmp2.s tmp3.s tmp4.s
+
+# 関数を1つずつ吐き出すストリーミングモードでも tests が通るか調べる
+./9cc --stream tests > tmp.s || exit 1
+gcc -static -o tmp tmp.s
+check "--stream tests" './tmp > /dev/null' "OK" "failed"
+
+# 2回目のコンパイルはキャッシュから同じアセンブリを取り出すか調べる
+rm -rf tmp.cache
+./9cc --cache-dir=tmp.cache tests > tmp.s 2> /dev/null || exit 1
+stats=$(./9cc --cache-dir=tmp.cache --cache-stats tests 2>&1 > tmp2.s)
+check "--cache-dir tests (twice)" '[ "$stats" = "cache: 1 hits, 0 misses, 0 evicted" ] && cmp -s tmp.s tmp2.s' \
+    "$stats" "expected 1 hit with the same output, but got: $stats"
+rm -rf tmp.cache tmp2.s
+
+# 1つの関数だけ変えて作り直すと、残りの関数は前回のアセンブリを使い回すか調べる
+rm -rf tmp.d
+mkdir -p tmp.d
+echo 'int sub(int a, int b) { return a-b; } int main() { return sub(7, 2); }' > tmp.c
+./9cc --incremental -o tmp.d tmp.c || exit 1
+echo 'int sub(int a, int b) { return a-b; } int main() { return sub(9, 2); }' > tmp.c
+stats=$(./9cc --incremental --cache-stats -o tmp.d tmp.c 2>&1) || exit 1
+./9cc tmp.c > tmp.s || exit 1
+gcc -static -o tmp tmp.d/tmp.s
+./tmp
+actual="$?"
+check "--incremental (one function changed)" \
+    '[ "$stats" = "incremental: 1 of 2 functions reused" ] && cmp -s tmp.s tmp.d/tmp.s && [ "$actual" = 7 ]' \
+    "$stats" "expected 1 of 2 reused and exit 7, but got: $stats, $actual"
+rm -rf tmp.d tmp.c
+
+# コンパイルサーバーを通しても、その場でコンパイルしたときと同じアセンブリとエラーになるか調べる
+./9cc --server=tmp.sock &
+server=$!
+for i in $(seq 50); do [ -S tmp.sock ] && break; sleep 0.1; done
+mode=$(stat -c %a tmp.sock)
+./9cc --client=tmp.sock tests > tmp2.s || exit 1
+./9cc tests > tmp.s || exit 1
+echo 'int main() { return x; }' | ./9cc --client=tmp.sock - > /dev/null 2> tmp.err
+status="$?"
+
+# 記述子の数が正しくない要求を送っても、サーバーが受け取った記述子を閉じるか調べる
+cat <<EOF | gcc -xc -o tmp-badreq -
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+int main(int argc, char **argv) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, argv[1]);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    return 1;
+  int nfds = atoi(argv[2]);
+  int hdr[2] = { 1, 2 };
+  int fds[16] = {};
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = { hdr, sizeof(hdr) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  if (sendmsg(sock, &msg, 0) < 0)
+    return 1;
+  char c;
+  return read(sock, &c, 1) != 0;
+}
+EOF
+before=$(ls /proc/$server/fd | wc -l)
+for i in $(seq 10); do ./tmp-badreq tmp.sock 3 && ./tmp-badreq tmp.sock 16 || exit 1; done
+after=$(ls /proc/$server/fd | wc -l)
+
+# 引数を送らずに止まったクライアントがいても、次の要求が処理されるか調べる
+./tmp-badreq tmp.sock 4 &
+stalled=$!
+sleep 0.2
+timeout 10 ./9cc --client=tmp.sock tests > tmp2.s
+unstalled="$?"
+kill $server
+wait $stalled
+rm -f tmp.sock tmp-badreq
+check "--client tests" \
+    'cmp -s tmp.s tmp2.s && [ "$status" = 1 ] && grep -q "定義されていない変数です" tmp.err && [ "$mode" = 600 ] &&
+     [ "$before" = "$after" ] && [ "$unstalled" = 0 ]' \
+    "same output" "expected the same output, an error for an undefined variable, a 0600 socket, no leaked fds and no stall, but got mode $mode, $before -> $after fds and status $unstalled after a stalled client"
+rm -f tmp2.s tmp.err
+
+# ライブラリ (libninecc.a) でメモリ上のソースをコンパイルしても、9cc と同じアセンブリになるか調べる
+make -s ninecc-bench > /dev/null || exit 1
+./9cc tests > tmp.s || exit 1
+./ninecc-bench tests 3 > tmp2.s 2> /dev/null || exit 1
+check "ninecc_compile tests" 'cmp -s tmp.s tmp2.s' "same output" "expected the same output as 9cc"
+rm -f tmp2.s
+
+# ライブラリの中の名前が、使う側のプログラムや libc (error(3)) の名前とぶつからないか調べる
+cat <<EOF | gcc -xc -static -o tmp - -L. -lninecc -pthread 2> tmp.err
+#include "ninecc.h"
+int cc;
+void error(void) {}
+int tokenize(void) { return 2; }
+int main() {
+  NineccBuffer out;
+  int status = ninecc_compile("int main() { return 5; }", 24, 0, &out);
+  ninecc_buffer_free(&out);
+  return status + cc + tokenize();
+}
+EOF
+./tmp
+actual="$?"
+check "libninecc.a with error, tokenize and cc" '[ "$actual" = 2 ]' "$actual" "expected to link and return 2, but got $actual: $(cat tmp.err)"
+rm -f tmp.err
+
+# --time-report と --mem-report はフェーズとオブジェクトの種類ごとに表示し、
+# --trace は関数ごとの区間を含むトレースを書くか調べる
+report=$(./9cc --time-report --mem-report --trace=tmp.json tests 2>&1 > /dev/null) || exit 1
+check "--time-report --mem-report --trace tests" \
+    'echo "$report" | grep -q "^  codegen " && echo "$report" | grep -q "^  node " &&
+     echo "$report" | grep -q "peak RSS" && grep -q "\"cat\":\"codegen\",\"name\":\"main\"" tmp.json' \
+    "OK" "missing phases, kinds or function spans"
+rm -f tmp.json
+
+# --codegen-stats は関数ごとの命令の数などを JSON Lines で書くか調べる
+echo 'int f(int x) { return x; } int main() { int a; a = f(3); if (a) return a; return 0; }' > tmp.c
+stats=$(./9cc --codegen-stats tmp.c 2>&1 > /dev/null | grep '"main"')
+expected='{"file":"tmp.c","function":"main","insns":44,"push_pop_pairs":9,"loads":2,"stores":1,"branches":5,"calls":2,"frame_size":8}'
+check "--codegen-stats main" '[ "$stats" = "$expected" ]' "OK" "$expected expected, but got $stats"
+
+# 計測用のカウンタの inc QWORD PTR [...] は、読み込みと書き込みの両方に数える
+stats=$(./9cc -fprofile-generate=tmp.prof --codegen-stats tmp.c 2>&1 > /dev/null | grep '"main"')
+check "-fprofile-generate --codegen-stats main" '[[ "$stats" == *\"loads\":5,\"stores\":4,* ]]' "OK" \
+    "expected 5 loads and 4 stores with 3 counters, but got $stats"
+rm -f tmp.c tmp.prof
+
+# --cost-report はループの中の idiv を含む、コストの高いループを表示するか調べる
+printf 'int f(int n) {\n  int s; int i; int j;\n  s = 0;\n  for (i = 0; i < n; i = i + 1)\n    for (j = 1; j < n; j = j + 1)\n      s = s + i / j;\n  return s;\n}\nint main() { return f(3); }\n' > tmp.c
+report=$(./9cc --cost-report tmp.c 2>&1 > /dev/null)
+check "--cost-report nested loop" 'echo "$report" | grep -q " 2  tmp.c:5 in f (1 idiv)$"' \
+    "OK" "expected tmp.c:5 at depth 2 with an idiv, but got:
+$report"
+rm -f tmp.c
+
+# -fprofile-generate で埋め込んだカウンタが、呼ばれた回数と条件が真だった回数を数えるか調べる
+printf 'int f(int x) { if (x < 3) return 1; return 0; }\nint main() { int i; int n; n = 0; for (i = 0; i < 10; i = i + 1) n = n + f(i); return n; }\n' > tmp.c
+rm -f tmp.prof
+./9cc -fprofile-generate=tmp.prof tmp.c > tmp.s || exit 1
+gcc -static -o tmp tmp.s tmp2.o
+./tmp
+actual="$?"
+expected='tmp.c f 3 10 10 3
+tmp.c main 3 1 11 10'
+check "-fprofile-generate" '[ "$actual" = 3 ] && [ "$(cat tmp.prof)" = "$expected" ]' \
+    "OK" "expected 3 and the counters
+$expected
+but got $actual and
+$(cat tmp.prof)"
+rm -f tmp.c tmp.prof
+
+# -fprofile-use で、よく通る方を分岐の直後に置き、一度も通らなかった方を .text.unlikely に移すか調べる
+printf 'int f(int x) { if (x < 3) return 1; else return 2; }\nint g(int x) { if (x == 50) return 7; return 0; }\nint main() { int i; int n; n = 0; for (i = 0; i < 10; i = i + 1) n = n + f(i) + g(i); return n; }\n' > tmp.c
+rm -f tmp.prof
+./9cc -fprofile-generate=tmp.prof tmp.c > tmp.s || exit 1
+gcc -static -o tmp tmp.s tmp2.o
+./tmp
+./9cc -fprofile-use=tmp.prof tmp.c > tmp.s || exit 1
+gcc -static -o tmp tmp.s tmp2.o
+./tmp
+actual="$?"
+check "-fprofile-use" \
+    '[ "$actual" = 17 ] && grep -q "^  jne .L.then.f.1$" tmp.s &&
+     grep -A1 "^.pushsection .text.unlikely$" tmp.s | grep -q "^.L.then.g.1:$"' \
+    "OK" "expected 17 with the hot else of f falling through and the then of g in .text.unlikely, but got $actual
+$(cat tmp.s)"
+rm -f tmp.c tmp.prof
+
+# -g で文ごとの行番号が、.type と .size で関数とグローバル変数の大きさが、実行ファイルに入るか調べる
+printf 'int g1;\nint f(int x) {\n  int y;\n  y = x * 2;\n  return y;\n}\nint main() { return f(3); }\n' > tmp.c
+./9cc -g tmp.c > tmp.s || exit 1
+gcc -static -o tmp tmp.s tmp2.o
+./tmp
+actual="$?"
+line=$(objdump -d -l tmp | awk '/<f>:/ { f = 1 } f && /tmp\.c:/ { loc = $1 } f && /imul/ { print loc; exit }')
+# f の大きさはコード生成によって変わるので、0 でないことだけを調べる
+syms=$(readelf -sW tmp | awk '$8 == "f" { print $8, $4, ($3 > 0) } $8 == "g1" { print $8, $4, $3 }' | sort | tr '\n' ' ')
+check "-g" '[ "$actual" = 6 ] && [[ "$line" == *tmp.c:4 ]] && [ "$syms" = "f FUNC 1 g1 OBJECT 8 " ]' \
+    "OK" "expected 6, imul at tmp.c:4, f as a FUNC of non-zero size and g1 as an 8-byte OBJECT, but got $actual, $line, $syms"
+rm -f tmp.c
+
+# トップレベルの宣言子を1回だけ読んで、構造体型のグローバル変数と、ポインタを返す関数を見分けられるか調べる
+assert 9 'struct { int a; char b; int c[4]; } g1; struct { int a; char b; int c[4]; } g2[2]; int *p() { return &g1.c[0]; } int main() { g1.c[3]=7; g2[1].b=2; int *q=p(); return q[3] + g2[1].b; }'
+
 echo OK
@@ -1,27 +1,42 @@
 #include "9cc.h"
 
-char *filename;
-char *user_input;
-Token *token;
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+#endif
+
+// 目的：エラーを報告した後、コンパイル中なら compile() に戻り、そうでなければ exit する
+// bail : void -> void
+void bail(void) {
+  if (cc)
+    longjmp(cc->jmpbuf, 1);
+  exit(1);
+}
 
+// 目的：エラーメッセージの出力先を返す
+// err_out : void -> FILE
+static FILE *err_out(void) {
+  return cc ? cc->err : stderr;
+}
 
 // エラーを報告するための関数
 // printfと同じ引数を取る
 void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  exit(1);
+  vfprintf(err_out(), fmt, ap);
+  fprintf(err_out(), "\n");
+  bail();
 }
 
-// エラー箇所を下記のフォーマットで報告し exit する
+// エラー箇所を下記のフォーマットで報告し、compile() に戻る
 // foo.c:10: x = y + 1;
 //               ^ <error message here>
-static void verror_at(char *loc, char *fmt, va_list ap) {
+static noreturn void verror_at(char *loc, char *fmt, va_list ap) {
+  FILE *out = cc->err;
+
   // loc が含まれている行の開始地点と終了地点を取得
   char *line = loc;
-  while (user_input < line && line[-1] != '\n')
+  while (cc->user_input < line && line[-1] != '\n')
     line--;
 
   char *end = loc;
@@ -30,21 +45,21 @@ static void verror_at(char *loc, char *fmt, va_list ap) {
   
   // 見つかった行が全体の何行目なのか調べる
   int line_num = 1;
-  for (char *p = user_input; p < line; p++)
+  for (char *p = cc->user_input; p < line; p++)
     if (*p == '\n')
       line_num++;
   
   // 見つかった行を、ファイル名と行番号と一緒に表示
-  int indent = fprintf(stderr, "%s:%d: ", filename, line_num);
-  fprintf(stderr, "%.*s\n", (int)(end - line), line);
+  int indent = fprintf(out, "%s:%d: ", cc->filename, line_num);
+  fprintf(out, "%.*s\n", (int)(end - line), line);
 
   // エラー箇所を"^"で指し示して、エラーメッセージを表示
   int pos = loc - line + indent;
-  fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
-  fprintf(stderr, "^ ");
-  vfprintf(stderr, fmt, ap); // まとめられた変数で処理する
-  fprintf(stderr, "\n");
-  exit(1);
+  fprintf(out, "%*s", pos, ""); // pos個の空白を出力
+  fprintf(out, "^ ");
+  vfprintf(out, fmt, ap); // まとめられた変数で処理する
+  fprintf(out, "\n");
+  bail();
 }
 
 // エラー箇所を報告する
@@ -55,86 +70,212 @@ void error_at(char *loc, char *fmt, ...) {
 }
 
 // エラー箇所を報告する
-void error_tok(Token *tok, char *fmt, ...) {
+void error_tok(int tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->str, fmt, ap);
+  verror_at(tok_str(tok), fmt, ap);
+}
+
+// 目的：トークンの添字を受け取り、入力中のトークンの文字列の先頭を返す
+// tok_str : int -> char *
+char *tok_str(int tok) {
+  return cc->user_input + cc->tokens.loc[tok];
+}
+
+// 目的：各行の先頭のバイトオフセットを並べた索引 cc->line_starts を作る
+// build_line_index : void -> void
+static void build_line_index(void) {
+  int cap = 1024;
+  cc->line_starts = malloc(cap * sizeof(int));
+  cc->line_starts[0] = 0;
+  cc->nlines = 1;
+  for (char *p = cc->user_input; (p = strchr(p, '\n')); p++) {
+    if (cc->nlines == cap) {
+      cap *= 2;
+      cc->line_starts = realloc(cc->line_starts, cap * sizeof(int));
+    }
+    cc->line_starts[cc->nlines++] = p + 1 - cc->user_input;
+  }
+}
+
+// 目的：トークンを含む行の、索引の中での添字を返す。
+// 索引はデバッグ情報を吐き出すときはトークナイズのときに作り、そうでなければ初めて呼ばれたときに作る
+// line_index : int -> int
+static int line_index(int tok) {
+  if (!cc->line_starts)
+    build_line_index();
+
+  // 先頭が loc 以下の最後の行を探す
+  int loc = cc->tokens.loc[tok];
+  int lo = 0, hi = cc->nlines;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (cc->line_starts[mid] <= loc)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// 目的：トークンが入力の何行目にあるかを返す
+// tok_line : int -> int
+int tok_line(int tok) {
+  return line_index(tok) + 1;
+}
+
+// 目的：トークンが行の何桁目 (バイト単位、1 から始まる) にあるかを返す
+// tok_column : int -> int
+int tok_column(int tok) {
+  return cc->tokens.loc[tok] - cc->line_starts[line_index(tok)] + 1;
+}
+
+// 目的：整数トークンの値を返す
+// tok_val : int -> long
+long tok_val(int tok) {
+  return cc->tokens.vals[cc->tokens.aux[tok]];
+}
+
+// 目的：文字列リテラルのトークンの中身を返す
+// tok_strlit : int -> StrLit
+StrLit *tok_strlit(int tok) {
+  return &cc->tokens.strs[cc->tokens.aux[tok]];
+}
+
+// 目的：cc->tokens のトークンを1行に1つずつ「種類 位置 長さ」の形で out に書き出す。
+// 整数には値を、文字列リテラルには中身の長さと中身を続ける
+// print_tokens : FILE -> void
+void print_tokens(FILE *out) {
+  TokenStream *ts = &cc->tokens;
+  for (int tok = 1; tok < ts->cnt; tok++) {
+    fprintf(out, "%d %d %d", ts->kind[tok], ts->loc[tok], ts->len[tok]);
+    if (ts->kind[tok] == TK_NUM)
+      fprintf(out, " %ld", tok_val(tok));
+    if (ts->kind[tok] == TK_STR) {
+      StrLit *str = tok_strlit(tok);
+      fprintf(out, " %d ", str->len);
+      fwrite(str->contents, 1, str->len, out);
+    }
+    fputc('\n', out);
+  }
+}
+
+// 目的：現在のトークンが記号 op と等しいかどうかを調べる
+// equal : char * -> bool
+static bool equal(char *op) {
+  return cc->tokens.kind[cc->token] == TK_RESERVED &&
+         strlen(op) == cc->tokens.len[cc->token] &&
+         !strncmp(tok_str(cc->token), op, cc->tokens.len[cc->token]); // 引数1と引数2を引数3のバイト数分だけ比較する。=だと0、それ以外だと正負の値を返す
 }
 
 // 次のトークンが期待している記号の時には、トークンを1つ読み進めて
-// トークンのポインタを返す。違う場合は NULL を返す。
-Token *consume(char *op) {
-  if (token->kind != TK_RESERVED ||
-      strlen(op) != token->len ||
-      strncmp(token->str, op, token->len)) // 引数1と引数2を引数3のバイト数分だけ比較する。=だと0、それ以外だと正負の値を返す
-    return NULL;
-  Token *t = token;
-  token = token->next;
-  return t;
+// トークンの添字を返す。違う場合は 0 を返す。
+int consume(char *op) {
+  if (!equal(op))
+    return 0;
+  return cc->token++;
 }
 
 // 目的：文字列を受け取り、現在のトークンとマッチするかどうかを調べる。
-// マッチしていれば、トークンを返す。
-// peek : char * -> Token || NULL
-Token *peek(char *s) {
-  if (token->kind != TK_RESERVED || strlen(s) != token->len ||
-      strncmp(token->str, s, token->len))
-    return NULL;
-  return token;
+// マッチしていれば、トークンの添字を返す。
+// peek : char * -> int || 0
+int peek(char *s) {
+  if (!equal(s))
+    return 0;
+  return cc->token;
 }
 
 // 目的：トークンの種類が識別子かどうかを調べる。
-// 違う場合は NULL を返す。もしそうなら、トークンを1つ読み進めてそのポインタを返す。
-// consume_ident : Void -> NULL || *Token
-Token *consume_ident(void) {
-  if (token->kind != TK_IDENT)
-    return NULL;
-  Token *t = token;
-  token = token->next;
-  return t;
+// 違う場合は 0 を返す。もしそうなら、トークンを1つ読み進めてその添字を返す。
+// consume_ident : Void -> 0 || int
+int consume_ident(void) {
+  if (cc->tokens.kind[cc->token] != TK_IDENT)
+    return 0;
+  return cc->token++;
 }
 
 // 次のトークンが期待している記号の時には、トークンを1つ読み進める。
 // それ以外の場合にはエラーを報告する。
 void expect(char *s) {
-  if (!peek(s))
-    error_tok(token, "'%s'ではありません", s);
-  token = token->next;
+  if (!equal(s))
+    error_tok(cc->token, "'%s'ではありません", s);
+  cc->token++;
 }
 
 // 次のトークンが数値の場合、トークンを１つ読み進めてその数値を返す。
 // それ以外の場合にはエラーを報告する。
 long expect_number(void) {
-  if (token->kind != TK_NUM)
-    error_tok(token, "数ではありません");
-  long val = token->val;
-  token = token->next;
-  return val;
+  if (cc->tokens.kind[cc->token] != TK_NUM)
+    error_tok(cc->token, "数ではありません");
+  return tok_val(cc->token++);
 }
 
 // 目的：現在のトークンが識別子だった場合、トークンを１つ読み進めつつ、現在のトークンの識別子を返す。
 // expect_ident : void -> char || NULL
 char *expect_ident(void) {
-  if (token->kind != TK_IDENT)
-    error_tok(token, "識別子ではありません");
-  char *s = strndup(token->str, token->len);
-  token = token->next;
+  if (cc->tokens.kind[cc->token] != TK_IDENT)
+    error_tok(cc->token, "識別子ではありません");
+  char *s = arena_strndup(&cc->file_arena, tok_str(cc->token), cc->tokens.len[cc->token]);
+  cc->token++;
   return s;
 }
 
 // 目的：トークンの種類がTK_EOFかどうかを調べる
 // at_eof : bool
 bool at_eof() {
-  return token->kind == TK_EOF;
+  return cc->tokens.kind[cc->token] == TK_EOF;
+}
+
+// 目的：配列 p を要素数 cap に広げた配列を返す
+// grow_array : void * -> int -> int -> void *
+static void *grow_array(void *p, int cap, int size) {
+  return realloc(p, (size_t)cap * size);
+}
+
+// 新しいトークンをトークン列 ts の末尾に追加し、その添字を返す
+static int new_token(TokenStream *ts, TokenKind kind, char *str, int len) {
+  if (ts->cnt == ts->cap) {
+    ts->cap = ts->cap ? ts->cap * 2 : 1024;
+    ts->kind = grow_array(ts->kind, ts->cap, sizeof(*ts->kind));
+    ts->loc  = grow_array(ts->loc,  ts->cap, sizeof(*ts->loc));
+    ts->len  = grow_array(ts->len,  ts->cap, sizeof(*ts->len));
+    ts->aux  = grow_array(ts->aux,  ts->cap, sizeof(*ts->aux));
+  }
+
+  int tok = ts->cnt++;
+  ts->kind[tok] = kind;
+  ts->loc[tok]  = str - cc->user_input;
+  ts->len[tok]  = len;
+  ts->aux[tok]  = 0;
+  return tok;
+}
+
+// 整数トークンを追加し、その値を vals に格納する
+static int new_num_token(TokenStream *ts, char *str, int len, long val) {
+  if (ts->nvals == ts->vals_cap) {
+    ts->vals_cap = ts->vals_cap ? ts->vals_cap * 2 : 256;
+    ts->vals = grow_array(ts->vals, ts->vals_cap, sizeof(*ts->vals));
+  }
+
+  int tok = new_token(ts, TK_NUM, str, len);
+  ts->aux[tok] = ts->nvals;
+  ts->vals[ts->nvals++] = val;
+  return tok;
 }
 
-// 新しいトークンを作成してcurに繋げる
-static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-  Token *tok = calloc(1, sizeof(Token));
-  tok->kind = kind;
-  tok->str  = str;
-  tok->len  = len;
-  cur->next = tok;
+// 文字列リテラルのトークンを追加し、その中身を strs に格納する。owned なら contents はトークン列と一緒に解放する
+static int new_str_token(TokenStream *ts, char *str, int len, char *contents, int str_len, bool owned) {
+  if (ts->nstrs == ts->strs_cap) {
+    ts->strs_cap = ts->strs_cap ? ts->strs_cap * 2 : 64;
+    ts->strs = grow_array(ts->strs, ts->strs_cap, sizeof(*ts->strs));
+  }
+
+  int tok = new_token(ts, TK_STR, str, len);
+  ts->aux[tok] = ts->nstrs;
+  ts->strs[ts->nstrs].contents = contents;
+  ts->strs[ts->nstrs].len = str_len;
+  ts->strs[ts->nstrs].owned = owned;
+  ts->nstrs++;
   return tok;
 }
 
@@ -156,6 +297,178 @@ static bool is_alnum(char c) {
   return is_alpha(c) || ('0' <= c && c <= '9');
 }
 
+//
+// 走査カーネル
+//
+// 空白、識別子、コメントの読み飛ばしを SSE2 で16バイトずつ行う。
+// 読み込みは16バイト境界に揃えたブロック単位で行い、p より前のバイトはマスクで捨てる。
+// 揃えたロードはページ境界をまたがないので、入力の終端 '\0' の後ろまで読んでも安全。
+// SSE2 が使えない場合や NO_SIMD が定義されている場合は1バイトずつ調べる。
+//
+
+#if defined(__SSE2__) && !defined(NO_SIMD)
+
+// 目的：ブロック中のバイトが c と等しい位置のビットマスクを返す
+// match_byte : __m128i -> char -> unsigned
+static unsigned match_byte(__m128i v, char c) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+// 目的：ブロック中のバイトが lo 以上 hi 以下である位置のビットマスクを返す
+// match_range : __m128i -> char -> char -> unsigned
+static unsigned match_range(__m128i v, char lo, char hi) {
+  __m128i ge = _mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1));
+  __m128i le = _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1));
+  return _mm_movemask_epi8(_mm_and_si128(ge, le));
+}
+
+// 目的：p 以降で最初の空白でない文字を返す
+// skip_space : char * -> char *
+static char *skip_space(char *p) {
+  int off = (uintptr_t)p & 15;
+  __m128i *q = (__m128i *)(p - off);
+  unsigned mask = (0xffff << off) & 0xffff;
+
+  for (;; q++, mask = 0xffff) {
+    __m128i v = _mm_load_si128(q);
+    unsigned space = match_byte(v, ' ') | match_range(v, '\t', '\r');
+    unsigned m = ~space & mask;
+    if (m)
+      return (char *)q + __builtin_ctz(m);
+  }
+}
+
+// 目的：p 以降で最初の識別子に使えない文字を返す
+// skip_ident : char * -> char *
+static char *skip_ident(char *p) {
+  int off = (uintptr_t)p & 15;
+  __m128i *q = (__m128i *)(p - off);
+  unsigned mask = (0xffff << off) & 0xffff;
+
+  for (;; q++, mask = 0xffff) {
+    __m128i v = _mm_load_si128(q);
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    unsigned alnum = match_range(lower, 'a', 'z') | match_range(v, '0', '9') |
+                     match_byte(v, '_');
+    unsigned m = ~alnum & mask;
+    if (m)
+      return (char *)q + __builtin_ctz(m);
+  }
+}
+
+// 目的：p 以降で最初の改行（なければ終端 '\0'）を返す
+// find_newline : char * -> char *
+static char *find_newline(char *p) {
+  int off = (uintptr_t)p & 15;
+  __m128i *q = (__m128i *)(p - off);
+  unsigned mask = (0xffff << off) & 0xffff;
+
+  for (;; q++, mask = 0xffff) {
+    __m128i v = _mm_load_si128(q);
+    unsigned m = (match_byte(v, '\n') | match_byte(v, '\0')) & mask;
+    if (m)
+      return (char *)q + __builtin_ctz(m);
+  }
+}
+
+// 目的：p 以降で最初の "*/" の位置を返す。見つからなければ NULL を返す
+// find_comment_end : char * -> char * || NULL
+static char *find_comment_end(char *p) {
+  int off = (uintptr_t)p & 15;
+  __m128i *q = (__m128i *)(p - off);
+  unsigned mask = (0xffff << off) & 0xffff;
+  unsigned carry = 0; // 直前のブロックの最後のバイトが '*' なら 1
+
+  for (;; q++, mask = 0xffff) {
+    __m128i v = _mm_load_si128(q);
+    unsigned star = match_byte(v, '*') & mask;
+    unsigned slash = match_byte(v, '/') & mask;
+    unsigned zero = match_byte(v, '\0') & mask;
+
+    if (carry && (slash & 1))
+      return (char *)q - 1;
+
+    // '*' の次のバイトが '/' である位置
+    unsigned m = star & (slash >> 1);
+    if (m || zero) {
+      int i = m ? __builtin_ctz(m) : 16;
+      if (zero && __builtin_ctz(zero) < i)
+        return NULL;
+      return (char *)q + i;
+    }
+    carry = star >> 15;
+  }
+}
+
+// 目的：p 以降で最初の '"', '/', 改行, '\0' のいずれかを返す。入力の分割位置の探索に使う
+// find_split_char : char * -> char *
+static char *find_split_char(char *p) {
+  int off = (uintptr_t)p & 15;
+  __m128i *q = (__m128i *)(p - off);
+  unsigned mask = (0xffff << off) & 0xffff;
+
+  for (;; q++, mask = 0xffff) {
+    __m128i v = _mm_load_si128(q);
+    unsigned m = (match_byte(v, '"') | match_byte(v, '/') |
+                  match_byte(v, '\n') | match_byte(v, '\0')) & mask;
+    if (m)
+      return (char *)q + __builtin_ctz(m);
+  }
+}
+
+// 目的：p 以降で最初の '"', '\\', '\0' のいずれかを返す。文字列リテラルの終わりを探すのに使う
+// find_quote : char * -> char *
+static char *find_quote(char *p) {
+  int off = (uintptr_t)p & 15;
+  __m128i *q = (__m128i *)(p - off);
+  unsigned mask = (0xffff << off) & 0xffff;
+
+  for (;; q++, mask = 0xffff) {
+    __m128i v = _mm_load_si128(q);
+    unsigned m = (match_byte(v, '"') | match_byte(v, '\\') | match_byte(v, '\0')) & mask;
+    if (m)
+      return (char *)q + __builtin_ctz(m);
+  }
+}
+
+#else
+
+static char *skip_space(char *p) {
+  while (isspace(*p))
+    p++;
+  return p;
+}
+
+static char *skip_ident(char *p) {
+  while (is_alnum(*p))
+    p++;
+  return p;
+}
+
+static char *find_newline(char *p) {
+  while (*p != '\n' && *p != '\0')
+    p++;
+  return p;
+}
+
+static char *find_comment_end(char *p) {
+  return strstr(p, "*/");
+}
+
+static char *find_split_char(char *p) {
+  while (*p && *p != '"' && *p != '/' && *p != '\n')
+    p++;
+  return p;
+}
+
+static char *find_quote(char *p) {
+  while (*p && *p != '"' && *p != '\\')
+    p++;
+  return p;
+}
+
+#endif
+
 // 目的：文字列を受けとり、return, if, else, while, for, int,
 // あるいは、複数文字の区切り記号のどれかに等しければ該当文字列を返す
 // *starts_with_reserved : char * -> char
@@ -196,62 +509,67 @@ static char get_escape_char(char c) {
   }
 }
 
-// 目的：トークンと文字列を受けとり、文字列リテラルの新しいトークンを返す
-// read_string_literal : Token -> char -> Token
-static Token *read_string_literal(Token *cur, char *start) {
+// 目的：文字列を受けとり、文字列リテラルの新しいトークンを ts に追加してその長さを返す
+// 長さに上限はない。エスケープを含まないリテラルは入力をそのまま指し、コピーしない。
+// read_string_literal : TokenStream -> char -> int
+static int read_string_literal(TokenStream *ts, char *start) {
+  // 閉じる '"' を探しながら、エスケープがあるかどうかを調べる
   char *p = start + 1;
-  char buf[1024];
-  int len = 0;
-
+  bool has_escape = false;
   for (;;) {
-    if (len == sizeof(buf))
-      error_at(start, "string literal too large");
+    p = find_quote(p);
     if (*p == '\0')
       error_at(start, "unclosed string literal");
     if (*p == '"')
       break;
-    
-    if (*p == '\\') {
-      p++;
-      buf[len++] = get_escape_char(*p++);
+    // '\\' の次の文字は閉じる '"' ではない
+    has_escape = true;
+    if (p[1] == '\0')
+      error_at(start, "unclosed string literal");
+    p += 2;
+  }
+
+  int toklen = p - start + 1;
+  if (!has_escape) {
+    new_str_token(ts, start, toklen, start + 1, p - start - 1, false);
+    return toklen;
+  }
+
+  // エスケープを展開すると元より短くなるので、元の長さの領域があれば足りる
+  char *buf = malloc(p - start);
+  int len = 0;
+  for (char *q = start + 1; q < p;) {
+    if (*q == '\\') {
+      buf[len++] = get_escape_char(q[1]);
+      q += 2;
     } else {
-      buf[len++] = *p++;
+      buf[len++] = *q++;
     }
   }
 
-  Token *tok = new_token(TK_STR, cur, start, p - start + 1);
-  tok->contents = malloc(len + 1);
-  memcpy(tok->contents, buf, len);
-  tok->contents[len] = '\0';
-  tok->cont_len = len + 1;
-  return tok;
+  new_str_token(ts, start, toklen, buf, len, true);
+  return toklen;
 }
 
-
-// 入力文字列 p をトークナイズしてそれを返す
-Token *tokenize(void) {
-  char *p = user_input;
-  Token head = {};
-  Token *cur = &head;
-
-  while (*p) {
+// 目的：入力の p から end までをトークナイズして ts に追加する
+// tokenize_range : TokenStream -> char * -> char * -> void
+static void tokenize_range(TokenStream *ts, char *p, char *end) {
+  while (p < end) {
     // 空白文字をスキップ
     if (isspace(*p)) {
-      p++;
+      p = skip_space(p + 1);
       continue;
     }
 
     // 行コメントをスキップ
     if (startswith(p, "//")) {
-      p += 2;
-      while (*p != '\n')
-        p++;
+      p = find_newline(p + 2);
       continue;
     }
 
     // ブロックコメントをスキップ
     if (startswith(p, "/*")) {
-      char *q = strstr(p + 2, "*/");
+      char *q = find_comment_end(p + 2);
       if (!q)
         error_at(p, "unclosed block comment");
       p = q + 2;
@@ -260,8 +578,7 @@ Token *tokenize(void) {
 
     // 文字列リテラルのトークン化
     if (*p == '"') {
-      cur = read_string_literal(cur, p);
-      p += cur->len;
+      p += read_string_literal(ts, p);
       continue;
     }
 
@@ -269,7 +586,7 @@ Token *tokenize(void) {
     char *kw = starts_with_reserved(p);
     if (kw) {
       int len = strlen(kw); // 該当キーワードの文字数
-      cur = new_token(TK_RESERVED, cur, p, len); // 新たなトークンを作り、cur に繋げる
+      new_token(ts, TK_RESERVED, p, len); // 新たなトークンを作り、トークン列に追加する
       p += len; // キーワードの文字数分、入力文字列を読み進める
       continue;
     }
@@ -277,10 +594,9 @@ Token *tokenize(void) {
     // 文字列 p が変数の場合、新しい識別子のトークンを作る。
     // 最初の文字は、a~z, A~Z, _のいずれか。
     if (is_alpha(*p)) {
-      char *q = p++;
-      while (is_alnum(*p))
-        p++;
-      cur = new_token(TK_IDENT, cur, q, p - q);
+      char *q = p;
+      p = skip_ident(p + 1);
+      new_token(ts, TK_IDENT, q, p - q);
       continue;
     }
 
@@ -288,22 +604,256 @@ Token *tokenize(void) {
     // 1文字のpunctuator
     // ispunct() はライブラリ関数
     if (ispunct(*p)) {
-      cur = new_token(TK_RESERVED, cur, p++, 1);
+      new_token(ts, TK_RESERVED, p++, 1);
       continue;
     }
 
     // 整数リテラル
     if (isdigit(*p)) {
-      cur = new_token(TK_NUM, cur, p, 0);
       char *q = p;
-      cur->val = strtol(p, &p, 10);
-      cur->len = p - q;
+      long val = strtol(p, &p, 10);
+      new_num_token(ts, q, p - q, val);
       continue;
     }
 
     error_at(p, "トークナイズできません");
   }
+}
+
+// 並列にトークナイズするときの1チャンクあたりの最小のバイト数
+#define MIN_CHUNK_SIZE (1024 * 1024)
+
+// 目的：入力を最大 n 個のチャンクに分ける位置を bounds に格納し、チャンクの数を返す。
+// 分割位置は、コメントや文字列リテラルの外にある改行の直後に限る。
+// チャンクの境界をまたぐトークンは存在しないので、各チャンクを独立にトークナイズできる。
+// split_input : char * -> char * -> int -> char ** -> int
+static int split_input(char *start, char *end, int n, char **bounds) {
+  long size = end - start;
+  int nchunks = 1;
+  char *target = start + size / n;
+  char *p = start;
+  bounds[0] = start;
+
+  while (nchunks < n && p < end) {
+    p = find_split_char(p);
+    if (!*p)
+      break;
+
+    // コメントや文字列リテラルの外の改行
+    if (*p == '\n') {
+      p++;
+      if (p >= target && p < end) {
+        bounds[nchunks++] = p;
+        target = start + size * nchunks / n;
+      }
+      continue;
+    }
+
+    // 文字列リテラルを読み飛ばす
+    if (*p == '"') {
+      p = find_quote(p + 1);
+      while (*p == '\\' && p[1])
+        p = find_quote(p + 2);
+      if (*p)
+        p++;
+      continue;
+    }
+
+    // 行コメントは改行の手前まで読み飛ばす
+    if (startswith(p, "//")) {
+      p = find_newline(p + 2);
+      continue;
+    }
+
+    // ブロックコメントを読み飛ばす
+    if (startswith(p, "/*")) {
+      char *q = find_comment_end(p + 2);
+      if (!q)
+        break;
+      p = q + 2;
+      continue;
+    }
+
+    p++;
+  }
+
+  bounds[nchunks] = end;
+  return nchunks;
+}
+
+// 1つのチャンクをトークナイズするワーカースレッドの引数
+// ワーカーは呼び出し元のコンパイラの写しを使い、エラーメッセージは errbuf に書く。
+// longjmp は別のスレッドには戻れないので、エラーは連結するときに呼び出し元のスレッドで報告する。
+typedef struct {
+  TokenStream ts;
+  char *start;
+  char *end;
+
+  Compiler *parent;
+  Compiler cc;
+  char *errbuf;
+  size_t errlen;
+  bool failed;
+} Chunk;
+
+static void *tokenize_chunk(void *arg) {
+  Chunk *c = arg;
+  Compiler *saved = cc;
+  c->cc = *c->parent;
+  c->cc.err = open_memstream(&c->errbuf, &c->errlen);
+  cc = &c->cc;
+
+  if (!setjmp(c->cc.jmpbuf))
+    tokenize_range(&c->ts, c->start, c->end);
+  else
+    c->failed = true;
+
+  fclose(c->cc.err);
+  cc = saved;
+  return NULL;
+}
+
+// 目的：チャンクごとのトークン列 src を dst の末尾に連結する
+// append_tokens : TokenStream -> TokenStream -> void
+static void append_tokens(TokenStream *dst, TokenStream *src) {
+  memcpy(dst->kind + dst->cnt, src->kind, src->cnt * sizeof(*src->kind));
+  memcpy(dst->loc + dst->cnt, src->loc, src->cnt * sizeof(*src->loc));
+  memcpy(dst->len + dst->cnt, src->len, src->cnt * sizeof(*src->len));
+  memcpy(dst->vals + dst->nvals, src->vals, src->nvals * sizeof(*src->vals));
+  memcpy(dst->strs + dst->nstrs, src->strs, src->nstrs * sizeof(*src->strs));
+
+  // vals と strs の添字を連結後の位置に付け替える
+  for (int i = 0; i < src->cnt; i++) {
+    int aux = src->aux[i];
+    if (src->kind[i] == TK_NUM)
+      aux += dst->nvals;
+    else if (src->kind[i] == TK_STR)
+      aux += dst->nstrs;
+    dst->aux[dst->cnt + i] = aux;
+  }
+
+  dst->cnt += src->cnt;
+  dst->nvals += src->nvals;
+  dst->nstrs += src->nstrs;
+
+  free(src->kind);
+  free(src->loc);
+  free(src->len);
+  free(src->aux);
+  free(src->vals);
+  free(src->strs);
+}
+
+// 目的：連結せずに終わるチャンクのトークン列とエラーメッセージを解放し、chunks も解放する
+// エスケープを含む文字列リテラルの中身は、チャンクの外に確保してある
+// free_chunks : Chunk * -> int -> void
+static void free_chunks(Chunk *chunks, int n) {
+  for (int i = 0; i < n; i++) {
+    TokenStream *ts = &chunks[i].ts;
+    for (int j = 0; j < ts->nstrs; j++)
+      if (ts->strs[j].owned)
+        free(ts->strs[j].contents);
+    free(ts->kind);
+    free(ts->loc);
+    free(ts->len);
+    free(ts->aux);
+    free(ts->vals);
+    free(ts->strs);
+    free(chunks[i].errbuf);
+  }
+  free(chunks);
+}
+
+// 目的：入力をチャンクに分け、ワーカースレッドで並列にトークナイズして cc->tokens に連結する
+// 結果は逐次にトークナイズした場合と同じになる。
+// tokenize_parallel : char * -> char * -> int -> void
+static void tokenize_parallel(char *start, char *end, int nthreads) {
+  char **bounds = calloc(nthreads + 1, sizeof(char *));
+  int n = split_input(start, end, nthreads, bounds);
+
+  Chunk *chunks = calloc(n, sizeof(Chunk));
+  pthread_t *threads = calloc(n, sizeof(pthread_t));
+  for (int i = 0; i < n; i++) {
+    chunks[i].start = bounds[i];
+    chunks[i].end = bounds[i + 1];
+    chunks[i].parent = cc;
+  }
+
+  // 先頭のチャンクはこのスレッドで処理する。
+  // スレッドを作れなかったときも、作ったスレッドが chunks を使い終わるまで待ってから報告する
+  int started = 1, err = 0;
+  for (; started < n; started++)
+    if ((err = pthread_create(&threads[started], NULL, tokenize_chunk, &chunks[started])))
+      break;
+  if (!err)
+    tokenize_chunk(&chunks[0]);
+  for (int i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(bounds);
+  free(threads);
+
+  if (err) {
+    free_chunks(chunks, n);
+    error("cannot create thread: %s", strerror(err));
+  }
+
+  // 逐次の場合と同じく、入力の先頭に最も近いエラーだけを報告する
+  for (int i = 0; i < n; i++) {
+    if (!chunks[i].failed)
+      continue;
+    fwrite(chunks[i].errbuf, 1, chunks[i].errlen, cc->err);
+    free_chunks(chunks, n);
+    bail();
+  }
+  for (int i = 0; i < n; i++)
+    free(chunks[i].errbuf);
+
+  // 連結後の大きさの配列を確保してから、チャンク順に連結する
+  TokenStream *ts = &cc->tokens;
+  int cnt = ts->cnt, nvals = 0, nstrs = 0;
+  for (int i = 0; i < n; i++) {
+    cnt += chunks[i].ts.cnt;
+    nvals += chunks[i].ts.nvals;
+    nstrs += chunks[i].ts.nstrs;
+  }
+  ts->cap = cnt + 1;
+  ts->kind = grow_array(ts->kind, ts->cap, sizeof(*ts->kind));
+  ts->loc  = grow_array(ts->loc,  ts->cap, sizeof(*ts->loc));
+  ts->len  = grow_array(ts->len,  ts->cap, sizeof(*ts->len));
+  ts->aux  = grow_array(ts->aux,  ts->cap, sizeof(*ts->aux));
+  ts->vals_cap = nvals + 1;
+  ts->vals = grow_array(ts->vals, ts->vals_cap, sizeof(*ts->vals));
+  ts->strs_cap = nstrs + 1;
+  ts->strs = grow_array(ts->strs, ts->strs_cap, sizeof(*ts->strs));
+
+  for (int i = 0; i < n; i++)
+    append_tokens(ts, &chunks[i].ts);
+  free(chunks);
+}
+
+// 入力文字列をトークナイズして cc->tokens に格納し、先頭のトークンの添字を返す
+// cc->tokenize_threads が 2 以上で入力が十分に大きい場合は、チャンクに分けて並列に処理する。
+int tokenize(void) {
+  char *start = cc->user_input;
+  char *end = start + strlen(start);
+  cc->tokens = (TokenStream){};
+
+  // 添字 0 は「トークンなし」を表すので、番兵を置いておく
+  new_token(&cc->tokens, TK_EOF, start, 0);
+
+  int nthreads = cc->tokenize_threads;
+  if (nthreads > (end - start) / MIN_CHUNK_SIZE)
+    nthreads = (end - start) / MIN_CHUNK_SIZE;
+
+  if (nthreads > 1)
+    tokenize_parallel(start, end, nthreads);
+  else
+    tokenize_range(&cc->tokens, start, end);
+
+  new_token(&cc->tokens, TK_EOF, end, 0);
 
-  new_token(TK_EOF, cur, p, 0);
-  return head.next;
+  // コード生成を並列に行うスレッドは Compiler の写しを使うので、行番号の索引は先に作っておく
+  if (cc->debug_info)
+    build_line_index();
+  return 1;
 }
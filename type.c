@@ -9,46 +9,86 @@ bool is_integer(Type *ty) {
     return ty->kind == TY_CHAR || ty->kind == TY_INT;
 }
 
+// 型の intern テーブル（オープンアドレス法）。
+// (kind, base, array_len) が等しい型は常に同じ Type オブジェクトを返すので、
+// 型の等価性はポインタの比較で判定できる。
+// テーブルは cc->type_table に置き、コンパイルごとに別々に持つ。
+
+// 目的：型の組 (kind, base, len) のハッシュ値を返す
+// hash_type : TypeKind -> Type -> int -> unsigned long
+static unsigned long hash_type(TypeKind kind, Type *base, int len) {
+    unsigned long h = (unsigned long)base;
+    h ^= h >> 17;
+    h = h * 0x9E3779B97F4A7C15UL + (unsigned long)kind;
+    h = h * 0x9E3779B97F4A7C15UL + (unsigned long)len;
+    return h ^ (h >> 29);
+}
+
+// 目的：テーブルの容量を倍にして、既存の型を入れ直す
+// grow_type_table : void -> void
+static void grow_type_table(void) {
+    int cap = cc->type_table_cap ? cc->type_table_cap * 2 : 256;
+    Type **table = calloc(cap, sizeof(Type *));
+
+    for (int i = 0; i < cc->type_table_cap; i++) {
+        Type *ty = cc->type_table[i];
+        if (!ty)
+            continue;
+        unsigned long h = hash_type(ty->kind, ty->base, ty->array_len);
+        int j = h & (cap - 1);
+        while (table[j])
+            j = (j + 1) & (cap - 1);
+        table[j] = ty;
+    }
+
+    free(cc->type_table);
+    cc->type_table = table;
+    cc->type_table_cap = cap;
+}
+
+// 目的：(kind, base, len) に対応する正準な Type を返す。なければ作って登録する
+// intern_type : TypeKind -> Type -> int -> Type
+static Type *intern_type(TypeKind kind, Type *base, int len) {
+    if (cc->type_table_used * 4 >= cc->type_table_cap * 3)
+        grow_type_table();
+
+    unsigned long h = hash_type(kind, base, len);
+    int i = h & (cc->type_table_cap - 1);
+    for (Type *ty; (ty = cc->type_table[i]); i = (i + 1) & (cc->type_table_cap - 1))
+        if (ty->kind == kind && ty->base == base && ty->array_len == len)
+            return ty;
+
+    note_alloc(MEM_TYPE, sizeof(Type));
+    Type *ty = arena_alloc(&cc->file_arena, sizeof(Type));
+    ty->kind = kind;
+    ty->base = base;
+    ty->array_len = len;
+    cc->type_table[i] = ty;
+    cc->type_table_used++;
+    return ty;
+}
+
 // 目的：Type 型の base ポインタを受け取り、それを指すポインタ型の Type を返す
 // pointer_to : Type -> Type
 Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_PTR;
+    Type *ty = intern_type(TY_PTR, base, 0);
     ty->size = 8;
-    ty->base = base;
     return ty;
 }
 
 // 目的：Type 型の base ポインタと配列の長さを受けとり、それらの型と要素数を持った配列を返す
 // array_of : Type -> int -> Type
 Type *array_of(Type *base, int len) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_ARRAY;
+    Type *ty = intern_type(TY_ARRAY, base, len);
     ty->size = base->size * len;
-    ty->base = base;
-    ty->array_len = len;
     return ty;
 }
 
-// 目的：各ノードに型の情報を加える（int / ポインタ）
+// 目的：ノードに型の情報を加える（int / ポインタ）
+// 子ノードにはすでに型がついている前提で、ノードを作ったときに一度だけ呼ぶ。
+// 部分木をたどらないので、深くネストした式でもスタックを消費しない。
 // add_type : Node -> void (引数の Node に型情報を加える)
 void add_type(Node *node) {
-    if (!node || node->ty)
-        return;
-    
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
-
-    for (Node *n = node->body; n; n = n->next)
-        add_type(n);
-    for (Node *n = node->args; n; n = n->next)
-        add_type(n);
-    
     switch (node->kind) {
         // 下記のケースでは、Nodeの型は int
         case ND_ADD: